@@ -1,9 +1,75 @@
 /*MODBUS.c*/
 #include "MODBUS.h"
+#if defined(__SSE2__)
+#include <immintrin.h>	//Encode_Words() kernels of the host build
+#endif
 
+#ifndef PID_ADDRESS	//can be defined in main.h of the port
 #define PID_ADDRESS 				0x08001FF0
+#endif
+
+#define MODBUS_BUFFER_SIZE			FRAME_BUFFER_SIZE
+#define LIMIT(standard, fit)		(((fit) < (standard)) ? (fit) : (standard))
+#define MAX_READ_REGISTERS			LIMIT(125, (MODBUS_BUFFER_SIZE - 5)/2)	//FC03/FC04 limit: 250 data bytes in one frame
+#define MAX_WRITE_REGISTERS			LIMIT(123, (MODBUS_BUFFER_SIZE - 9)/2)	//FC16 limit: 246 data bytes in one frame
+#define SCATTER_MAX_RANGES			LIMIT(16, (MODBUS_BUFFER_SIZE - 5)/4)	//FC67 limit of ranges in one request
+#define MAX_FIFO_VALUES				LIMIT(31, (MODBUS_BUFFER_SIZE - 8)/2)	//FC24 limit of values in one response
+#define CACHE_FRAME_SIZE			(5 + 2*RESPONSE_CACHE_REGISTERS)
+#define CAPTURE_HEADER_SIZE			7	//tick (4 bytes), frame length (2 bytes), stored length (1 byte)
+
+#define JOURNAL_MAGIC				0xA5A50000	//page header: magic in the high half, sequence number in the low half
+#define JOURNAL_ERASED				0xFFFFFFFF
+#define JOURNAL_NO_COMPACTION		0xFFFF
+#define JOURNAL_PAIR_FIRST			0x8000	//record index flag: the first word of a 32-bit value, valid only with the next record
+#define MAP_TEST(map, n)			((map)[(n)/8] & (1<<((n)%8)))	//bit maps of the journal, one bit per holding register
+#define MAP_SET(map, n)				((map)[(n)/8] |= (1<<((n)%8)))
+#define MAP_CLEAR(map, n)			((map)[(n)/8] &= ~(1<<((n)%8)))
+
+#define CYCLE_COUNTER				(HANDLER_PROFILING || TRAFFIC_STATISTICS)
+#define DELTA_HEADER_SIZE			9	//FC66 response: address, function code, byte count, bank, epoch, version, flags
+#define FW_BLOCK_SIZE				240	//FC68 data bytes per block, only the last block may be shorter
+#define FW_STAGED_MARKER			139	//buff_app_boot value: a verified image waits in the staging area
+
+/*FC68 sub-commands*/
+enum
+{
+	fw_start = 0,
+	fw_data = 1,
+	fw_status = 2,
+	fw_finish = 3
+};
+
+#if PERSISTENT_JOURNAL && (H_REG_COUNT + 2 > FLASH_PAGE_SIZE/4 - 1)
+#error "one journal page can not keep all holding registers and one more 32-bit value"
+#endif
+
+#if FRAME_BUFFER_SIZE < 64 || FRAME_BUFFER_SIZE > 256
+#error "FRAME_BUFFER_SIZE must be 64-256"
+#endif
+
+#if FIRMWARE_TRANSFER && (FRAME_BUFFER_SIZE < 8 + FW_BLOCK_SIZE)
+#error "FC68 blocks need FRAME_BUFFER_SIZE 248 or more"
+#endif
+
+#if FIRMWARE_TRANSFER && !RX_CIRCULAR_DMA && (FW_WINDOW_BLOCKS > 1)
+#error "FW_WINDOW_BLOCKS > 1 needs RX_CIRCULAR_DMA: the one-shot DMA is stopped while a block is programmed and loses the next ones"
+#endif
+
+#if FIRMWARE_TRANSFER && RX_CIRCULAR_DMA && ((RX_RING_SIZE < FW_WINDOW_BLOCKS * (8 + FW_BLOCK_SIZE)) || (RX_QUEUE_SIZE < FW_WINDOW_BLOCKS))
+#error "RX_RING_SIZE and RX_QUEUE_SIZE must keep FW_WINDOW_BLOCKS full FC68 data frames"
+#endif
 
-#define MODBUS_BUFFER_SIZE			0x100
+#if FIFO_COUNT && ((FIFO_SIZE & (FIFO_SIZE - 1)) || FIFO_SIZE > 0x8000)
+#error "FIFO_SIZE must be a power of two, max 32768"
+#endif
+
+#if BUS_CAPTURE && (CAPTURE_SNAP_LENGTH > MODBUS_BUFFER_SIZE - 7 - CAPTURE_HEADER_SIZE)
+#error "CAPTURE_SNAP_LENGTH does not fit into one FC65 response"
+#endif
+
+#if BUS_CAPTURE && (CAPTURE_BUFFER_SIZE < CAPTURE_HEADER_SIZE + CAPTURE_SNAP_LENGTH)
+#error "CAPTURE_BUFFER_SIZE can not keep one record of CAPTURE_SNAP_LENGTH bytes"
+#endif
 
 /*Modbus function codes*/
 enum function_code_e
@@ -12,6 +78,11 @@ enum function_code_e
 	read_input_registers = 0x04,
 	write_single_register = 0x06,
 	write_multiple_registers = 0x10,
+	read_fifo_queue = 0x18,
+	read_bus_capture = 0x41,
+	read_changed_registers = 0x42,
+	read_scattered_registers = 0x43,
+	firmware_transfer = 0x44,
 	error = 0x80
 };
 
@@ -23,13 +94,56 @@ enum
 	all_values = 2
 };
 
+/*periodic housekeeping job, run from MBR_Check_For_Request()*/
+struct job_s {
+	uint16_t period;	//ms
+	uint32_t next_run;	//cnt_modbus_tick value
+	void (*job)(void);
+};
+
+/*single producer, single consumer ring: the indexes run freely and wrap at 65536, a multiple of FIFO_SIZE*/
+struct fifo_s {
+	uint16_t value[FIFO_SIZE];
+	volatile uint16_t head;	//written only by MBR_FIFO_Push()
+	volatile uint16_t tail;	//written only by FC24
+};
+
+/*frame received into the circular DMA ring*/
+struct frame_s {
+	uint16_t offset;	//index of the first byte in buf_modbus_rx[]
+	uint16_t length;
+	uint32_t tick;	//HAL_GetTick() at the receiver timeout
+#if TRAFFIC_STATISTICS
+	uint32_t cycle;	//Get_Cycle_Count() at the receiver timeout
+#endif
+};
+
 struct response_s {
 	uint8_t exception;;
-	uint8_t frame_size;
+	uint16_t frame_size;
 	uint8_t flg_response;
+	uint8_t *frame;	//buf_modbus or a cached response
+};
+
+struct cache_entry_s
+{
+	uint16_t start_address;
+	uint16_t register_count;
+	uint16_t version;	//version of the bank when the response was encoded
+	uint16_t frame_size;	//0 = empty
+	uint8_t frame[CACHE_FRAME_SIZE];	//the address and the function code of the request are the first two bytes
 };
 
 extern const struct structHRVA RegVirtAddr[H_REG_COUNT];
+#if COMPILED_REG_MAP
+extern const struct structRegChecks RegChecks;	//MBR_REGISTER_MAP of MODBUS.hpp
+#endif
+#if SPARSE_REG_MAP
+extern const struct structHRRange RegRanges[H_RANGE_COUNT];
+#endif
+#if W_REG_COUNT
+extern const struct structHRWide RegWide[W_REG_COUNT];
+#endif
 
 /*associated with the bootloader*/
 volatile uint8_t __attribute__((section ("buf_section"))) buff_app_boot[0x10];
@@ -45,25 +159,99 @@ uint8_t flg_modbus_no_comm;
 /*for internal usage only*/
 UART_HandleTypeDef *modbus_huart;
 uint16_t cnt_modbus_no_comm;
-uint8_t len_modbus_frame;
+uint16_t len_modbus_frame;
 uint8_t buf_modbus[MODBUS_BUFFER_SIZE];
 uint8_t flg_modbus_packet_received;
 uint8_t flg_reinit_modbus;
-volatile uint16_t cnt_autoassignment_delay;
+uint8_t flg_autoassignment_mode;
+uint8_t flg_autoassignment_status;	//100 = waiting for command 100, 101 = recognized, 102 = confirmed, 111 = address assigned
+uint8_t flg_autoassignment_delay;	//recognition answer: 0 = none, 1 = delayed, 2 = delayed and the line is watched
+uint8_t buf_autoassignment[28];	//recognition answer sent by Send_Autoassignment_Response()
+uint32_t autoassignment_deadline;	//cnt_modbus_tick when the recognition answer is sent
+uint16_t cnt_autoassignment_dma;	//DMA counter when the watching started, any received byte changes it
+#if RX_CIRCULAR_DMA
+uint8_t buf_modbus_rx[RX_RING_SIZE];	//DMA ring, requests are copied to buf_modbus only when they are addressed to this device
+struct frame_s rx_queue[RX_QUEUE_SIZE];
+volatile uint8_t idx_rx_queue_head;	//written in the interrupt
+volatile uint8_t idx_rx_queue_tail;	//written in the main loop
+uint16_t ofs_rx_frame_start;	//ring index where the next frame starts
+uint16_t cnt_rx_dropped;	//frames lost because the queue was full
+volatile uint8_t flg_modbus_tx_busy;
+#endif
+volatile uint32_t cnt_modbus_tick;	//ms, the only variable touched in SysTick
+#if IDLE_LINE_FRAMING
+TIM_HandleTypeDef *frame_htim;	//counts us, period = receiver timeout minus one character
+volatile uint16_t cnt_frame_dma_left;	//DMA counter at the idle line, the frame ends if it does not change until the timer expires
+#endif
+#if FIFO_COUNT
+struct fifo_s modbus_fifo[FIFO_COUNT];
+#endif
+#if BUS_CAPTURE
+uint8_t buf_capture[CAPTURE_BUFFER_SIZE];
+uint16_t idx_capture_head;	//next byte to write
+uint16_t idx_capture_tail;	//first byte of the oldest record
+uint16_t cnt_capture_used;
+uint16_t cnt_capture_dropped;	//records overwritten before they were drained
+#if !RX_CIRCULAR_DMA
+volatile uint32_t tick_modbus_frame_end;	//HAL_GetTick() at the receiver timeout of the frame in buf_modbus
+#endif
+#endif
+#if HANDLER_PROFILING
+struct structHandlerStats handler_stats[profile_count];
+#endif
+#if TRAFFIC_STATISTICS
+struct structTrafficStats traffic_stats;
+volatile uint32_t cyc_modbus_frame_end;	//Get_Cycle_Count() at the end of the request being processed
+#endif
+#if DELTA_READ || RESPONSE_CACHE
+uint16_t hold_version;	//incremented on every holding register update
+uint16_t input_version;	//incremented on every input register change
+#endif
+#if RESPONSE_CACHE
+struct cache_entry_s response_cache[RESPONSE_CACHE];
+uint8_t idx_cache_victim;	//round robin replacement
+#endif
+#if DELTA_READ
+uint16_t delta_epoch;	//0 until the first FC66 request, then fixed until the next reset
+uint16_t hold_reg_version[H_REG_COUNT];	//hold_version at the last update of the register
+uint16_t input_reg_version[I_REG_COUNT];
+#endif
+#if FIRMWARE_TRANSFER
+uint32_t fw_image_size;
+uint32_t fw_crc32;	//running CRC32 of the blocks received in order
+uint32_t ofs_fw_erased;	//staging area is erased up to this offset
+uint16_t idx_fw_next_block;	//cumulative acknowledgement: all blocks before it are programmed
+uint8_t flg_fw_started;
+uint8_t flg_fw_jump;	//reset into the bootloader after the response is sent
+#endif
+#if PERSISTENT_JOURNAL
+uint16_t journal_value[H_REG_COUNT];	//RAM index: the latest value of every register
+uint8_t journal_valid[(H_REG_COUNT+7)/8];	//bit is set when the register has a value in the journal
+uint8_t journal_dirty[(H_REG_COUNT+7)/8];	//bit is set when the latest value is not programmed yet
+uint16_t journal_order[H_REG_COUNT];	//indexes in uint_hold_reg[] sorted by the virtual address, searched by Journal_Find_Register()
+uint16_t idx_journal_page;	//active page
+uint16_t idx_journal_sequence;	//sequence number of the active page
+uint16_t ofs_journal_write;	//next free word in the active page
+uint16_t idx_journal_copy;	//next register to copy into the new page, JOURNAL_NO_COMPACTION when idle
+uint8_t flg_journal_ready;
+#endif
 
 uint8_t (*Read_Dummy)(uint16_t, uint16_t*);
 uint8_t (*Write_Dummy)(uint16_t, uint16_t);
+#if W_REG_COUNT
+uint8_t (*Write_Pair_Dummy)(uint16_t, uint16_t, uint16_t, uint16_t);	//both words of a 32-bit value in one step, NULL = two Write_Dummy() calls
+#endif
 
 /*FUNCTION PROTOTYPES*/
 /*for internal use only*/
 static void Check_HW_FW_Version(void);
 static void Init_USART_DMA(void);
 static void Update_Communication_Parameters(void);
-static void Send_Response(uint8_t count);
+static void Send_Response(uint8_t *frame, uint16_t count);
 static void Init_Default_Values(uint8_t values);
-static void Check_Frame(void);
 static void Process_Autoassignment_Request(struct response_s *response_s);
-static uint8_t Detain_Autoasignment_Response(void);
+static void Send_Autoassignment_Response(void);
+static uint8_t Match_UID_Prefix(uint8_t *prefix, uint8_t bit_count);
 static void Set_DE_Pin(void);
 static void Reset_DE_Pin(void);
 static void Set_NBT_Pin(void);
@@ -71,10 +259,90 @@ static void Reset_NBT_Pin(void);
 static void Process_Request();
 static void Update_Data(uint16_t register_number, uint16_t reg_data);
 static void Check_Modbus_Registers(void);
+static uint8_t Find_Holding_Registers(uint16_t start_address, uint16_t register_count, uint16_t *index);
+static uint8_t Encode_Holding_Registers(uint16_t start_address, uint16_t register_count, uint8_t *dst);
+static uint8_t Encode_Input_Registers(uint16_t start_address, uint16_t register_count, uint8_t *dst);
+#if SCATTER_READ
+static void Read_Scattered_Registers(struct response_s *response_s);
+#endif
+#if DELTA_READ || RESPONSE_CACHE
+static void Advance_Version(uint16_t *version);
+#endif
+#if RESPONSE_CACHE
+static uint8_t Use_Cached_Response(struct response_s *response_s, uint16_t start_address, uint16_t register_count, uint16_t version);
+static void Cache_Response(uint16_t frame_size, uint16_t start_address, uint16_t register_count, uint16_t version);
+#endif
+static void Encode_Words(const uint16_t *src, uint16_t count, uint8_t *dst);
+#if FIFO_COUNT
+static void Read_FIFO_Queue(struct response_s *response_s);
+#endif
+static uint8_t Is_Writable(uint16_t index);
+static uint8_t Check_Register_Value(uint16_t index, uint16_t reg_data);
+#if W_REG_COUNT
+static const struct structHRWide *Find_Wide_Register(uint16_t index);
+static uint8_t Check_Wide_Value(const struct structHRWide *wide, uint16_t first_word, uint16_t second_word);
+static union unionWide Join_Wide_Words(const struct structHRWide *wide, uint16_t first_word, uint16_t second_word);
+static void Update_Wide_Data(const struct structHRWide *wide, uint16_t first_word, uint16_t second_word);
+#endif
 static void Send_Exeption(uint8_t exeption_code);
 static void Check_Communication_Reset_Jumper(void);
 static void Check_Modbus_Timeout(void);
 static uint16_t Calculate_CRC16(uint8_t *buf, uint16_t len);
+static uint16_t Update_CRC16(uint16_t crc, uint8_t *buf, uint16_t len);
+#if RX_CIRCULAR_DMA
+static void Check_Ring_Frame(struct frame_s *frame);
+static void Queue_Ring_Frame(void);
+#else
+static void Check_Frame(void);
+#endif
+static uint8_t Check_Frame_Length(uint8_t function_code, uint8_t sub_command, uint16_t length);
+static void Run_Scheduled_Jobs(void);
+#if BUS_CAPTURE
+static void Capture_Frame(uint8_t *buf, uint16_t size, uint16_t offset, uint16_t len, uint32_t tick);
+static void Read_Bus_Capture(struct response_s *response_s);
+#endif
+#if PERSISTENT_JOURNAL
+static void Journal_Init(void);
+static void Journal_Replay_Record(uint32_t record);
+static void Journal_Sort_Addresses(void);
+static uint16_t Journal_Find_Register(uint16_t address);
+static uint16_t Journal_Record_Count(uint16_t *index);
+static uint8_t Journal_Append(uint32_t page_address, uint16_t index, uint16_t count);
+static void Journal_Start_Compaction(void);
+static void Journal_Compaction_Step(void);
+#endif
+#if DELTA_READ
+static void Read_Changed_Registers(struct response_s *response_s);
+static uint16_t Get_Delta_Epoch(void);
+static uint8_t Encode_Changed_Bank(uint8_t bank, uint16_t version, uint32_t max_age, uint16_t *position);
+static uint8_t Encode_Changed_Runs(uint16_t start_address, uint16_t *values, uint16_t *versions, uint16_t count, uint16_t version, uint32_t max_age, uint16_t *position);
+#endif
+#if FIRMWARE_TRANSFER
+static void Firmware_Transfer(struct response_s *response_s);
+static uint8_t Firmware_Store_Block(uint32_t offset, uint8_t *data, uint16_t len);
+static void Firmware_Jump_To_Bootloader(void);
+static uint32_t Update_CRC32(uint32_t crc, uint8_t *buf, uint16_t len);
+#endif
+#if CYCLE_COUNTER
+static uint32_t Get_Cycle_Count(void);
+static uint8_t Get_Profiled_Handler(uint8_t function_code);
+#endif
+#if HANDLER_PROFILING
+static void Update_Handler_Stats(uint8_t handler, uint32_t start_cycle);
+#endif
+#if TRAFFIC_STATISTICS
+static void Update_Latency_Histogram(uint32_t cycles);
+#endif
+
+/*housekeeping jobs*/
+struct job_s modbus_jobs[] = {
+	{10,	10,		Check_Communication_Reset_Jumper},	//debounce: 5 samples
+	{1000,	1000,	Check_Modbus_Timeout},
+	{1,		1,		Send_Autoassignment_Response},
+#if PERSISTENT_JOURNAL
+	{JOURNAL_FLUSH_PERIOD,	JOURNAL_FLUSH_PERIOD,	MBR_Journal_Flush},
+#endif
+};
 
 //example of description:
 /**
@@ -105,15 +373,26 @@ void MBR_Init_Modbus(UART_HandleTypeDef *huart, void *read_handler, void *write_
 	Read_Dummy = read_handler;
 	Write_Dummy = write_handler;
 
+#if CYCLE_COUNTER && defined(DWT_CTRL_CYCCNTENA_Msk)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;	//Get_Cycle_Count() reads DWT->CYCCNT
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
 	Init_USART_DMA();
 
-	flg_init_eeprom = Read_Dummy(0xA001, &data);
+	flg_init_eeprom = Read_Dummy(MBR_FIRST_START_PROBE, &data);
 	if(flg_init_eeprom)	//check is this the first mcu startup
 	{
 		Init_Default_Values(all_values);
 	}
 
+#if HANDLER_PROFILING
+	uint32_t start_cycle = Get_Cycle_Count();
+	Check_Modbus_Registers();
+	Update_Handler_Stats(profile_check_modbus_registers, start_cycle);
+#else
 	Check_Modbus_Registers();
+#endif
 	Check_HW_FW_Version();	//check if there is new FW version
 
 	for (uint16_t i=0; i<H_REG_COUNT; i++)
@@ -149,456 +428,2220 @@ void MBR_Init_Modbus(UART_HandleTypeDef *huart, void *read_handler, void *write_
  */
 void MBR_Check_For_Request(void)
 {
+	Run_Scheduled_Jobs();
+
+#if RX_CIRCULAR_DMA
+	while((idx_rx_queue_tail != idx_rx_queue_head) && !flg_modbus_tx_busy)	//the response is built in buf_modbus, wait until it is sent
+	{
+		Check_Ring_Frame(&rx_queue[idx_rx_queue_tail]);
+		idx_rx_queue_tail = (idx_rx_queue_tail + 1) % RX_QUEUE_SIZE;
+	}
+
+	if(flg_modbus_packet_received)	//UART error: HAL has stopped the DMA
+	{
+		flg_modbus_packet_received = 0;
+#if TRAFFIC_STATISTICS
+		traffic_stats.uart_errors++;
+#endif
+		modbus_huart->ErrorCode = HAL_UART_ERROR_NONE;
+		ofs_rx_frame_start = 0;
+		HAL_UART_Receive_DMA(modbus_huart, buf_modbus_rx, RX_RING_SIZE);
+	}
+#else
 	if(flg_modbus_packet_received)
 	{
 		flg_modbus_packet_received = 0;
 
 		if(modbus_huart->ErrorCode == HAL_UART_ERROR_RTO)
 		{
+#if !IDLE_LINE_FRAMING	//taken in MBR_Timer_Callback() before the DMA was stopped
 			len_modbus_frame = MODBUS_BUFFER_SIZE - modbus_huart->hdmarx->Instance->CNDTR;
-			if(len_modbus_frame > 7)
+#endif
+#if TRAFFIC_STATISTICS
+			traffic_stats.frames++;
+#endif
+#if BUS_CAPTURE
+			Capture_Frame(buf_modbus, MODBUS_BUFFER_SIZE, 0, len_modbus_frame, tick_modbus_frame_end);
+#endif
+			if(Check_Frame_Length(buf_modbus[1], buf_modbus[2], len_modbus_frame))
 			{
 				Check_Frame();
 			}
 		}
 		else
 		{
+#if TRAFFIC_STATISTICS
+			traffic_stats.uart_errors++;
+#endif
 			modbus_huart->ErrorCode = HAL_UART_ERROR_NONE;	//called in HAL_UART_Receive_DMA() / HAL_UART_Receive_DMA() function
 		}
 
 		HAL_UART_Receive_DMA(modbus_huart, buf_modbus, MODBUS_BUFFER_SIZE);
 	}
+#endif
 }
 
+#if RX_CIRCULAR_DMA || IDLE_LINE_FRAMING
 /**
- * @brief Modbus clock. Should be called every 1ms.
+ * @brief Frame end detection in the USART interrupt.
+ *        RX_CIRCULAR_DMA: queue the frame that ended with the receiver timeout. The receiver timeout flag is cleared here,
+ *        so HAL_UART_IRQHandler() does not treat it as an error and does not stop the DMA.
+ *        IDLE_LINE_FRAMING: the line is idle for one character, start the timer for the rest of the receiver timeout.
  * @param none
  * @retval none
  */
-void MBR_Inc_Tick(void)
+void MBR_UART_IRQ_Handler(void)
 {
-	static uint16_t cnt_second;
-
-	if(cnt_second < 1000)
+#if IDLE_LINE_FRAMING
+	if(!__HAL_UART_GET_FLAG(modbus_huart, UART_FLAG_IDLE))
 	{
-		cnt_second++;
-	}
-	else
-	{
-		Check_Communication_Reset_Jumper();
-		Check_Modbus_Timeout();
+		return;
 	}
+	__HAL_UART_CLEAR_IDLEFLAG(modbus_huart);
 
-	if(cnt_autoassignment_delay > 0)
+	cnt_frame_dma_left = modbus_huart->hdmarx->Instance->CNDTR;
+	__HAL_TIM_SET_COUNTER(frame_htim, 0);
+	HAL_TIM_Base_Start_IT(frame_htim);	//already running when the frame continued after a shorter gap
+#else
+	if(!__HAL_UART_GET_FLAG(modbus_huart, UART_FLAG_RTOF))
 	{
-		cnt_autoassignment_delay--;
+		return;
 	}
+	__HAL_UART_CLEAR_FLAG(modbus_huart, UART_CLEAR_RTOF);
+
+	Queue_Ring_Frame();
+#endif
 }
+#endif
 
+#if IDLE_LINE_FRAMING
 /**
- * @brief Update holding register value in EEPROM and in the buffer.
- * @param none
+ * @brief Set the timer of the idle line framing. Call before MBR_Init_Modbus().
+ * @param htim timer with 1 us tick and update interrupt, the library sets its period and starts/stops it
  * @retval none
  */
-void MBR_Rewrite_Register(uint16_t register_number, uint16_t reg_data)
+void MBR_Init_Frame_Timer(TIM_HandleTypeDef *htim)
 {
-	Update_Data(register_number, reg_data);
+	frame_htim = htim;
 }
 
-
-/*CALLBACKS*/
 /**
- * @brief This function is called every time when DE pin state changes.
- * @param none
+ * @brief The line stayed idle for the whole receiver timeout: the frame is complete.
+ *        Gaps shorter than the timer period inside the frame are accepted (t1.5 is not checked, the CRC is).
+ * @param htim the timer from HAL_TIM_PeriodElapsedCallback()
  * @retval none
  */
-__weak void MBR_Switch_DE_Callback(uint8_t state)
+void MBR_Timer_Callback(TIM_HandleTypeDef *htim)
 {
-	UNUSED(state);	//can be ommited in C2X
+	if(htim != frame_htim)
+	{
+		return;
+	}
+	HAL_TIM_Base_Stop_IT(frame_htim);
+
+	if(modbus_huart->hdmarx->Instance->CNDTR != cnt_frame_dma_left)	//more bytes came, the next idle line starts the timer again
+	{
+		return;
+	}
+
+#if RX_CIRCULAR_DMA
+	Queue_Ring_Frame();
+#else
+	len_modbus_frame = MODBUS_BUFFER_SIZE - cnt_frame_dma_left;
+	HAL_UART_AbortReceive(modbus_huart);	//the reception is started again after the request is processed
+	modbus_huart->ErrorCode = HAL_UART_ERROR_RTO;	//same path as the receiver timeout of the USART
+	HAL_UART_ErrorCallback(modbus_huart);
+#endif
 }
+#endif
 
 /**
- * @brief This function is called every time when Modbus master tries to update holding register value.
+ * @brief Modbus clock. Should be called every 1ms. The jobs are run later from MBR_Check_For_Request().
  * @param none
- * @retval 0 = ok (new value is allowed), 1 = not ok (new value is not allowed)
+ * @retval none
  */
-__weak uint8_t MBR_Check_Restrictions_Callback(uint16_t register_address, uint16_t register_data)
+void MBR_Inc_Tick(void)
 {
-	UNUSED(register_address);
-	UNUSED(register_data);
-	return 0;
+	cnt_modbus_tick++;
 }
 
 /**
- * @brief This function is called when holding register value has been updated.
+ * @brief Update holding register value in EEPROM and in the buffer.
  * @param none
  * @retval none
  */
-__weak void MBR_Register_Update_Callback(uint16_t register_address, uint16_t register_data)
+void MBR_Rewrite_Register(uint16_t register_number, uint16_t reg_data)
 {
-	UNUSED(register_address);
-	UNUSED(register_data);
+	Update_Data(register_number, reg_data);
 }
 
-
-/*HAL CALLBACKS*/
-void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+/**
+ * @brief Update input register value in the buffer.
+ * @param register_number index in uint_input_reg[]
+ * @param reg_data new value
+ * @retval none
+ */
+void MBR_Publish_Input_Register(uint16_t register_number, uint16_t reg_data)
 {
-	flg_modbus_packet_received = 1;
+	if(uint_input_reg[register_number] == reg_data)
+	{
+		return;
+	}
+
+	uint_input_reg[register_number] = reg_data;
+#if DELTA_READ || RESPONSE_CACHE
+	Advance_Version(&input_version);
+#endif
+#if DELTA_READ
+	input_reg_version[register_number] = input_version;
+#endif
 }
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+#if RESPONSE_CACHE
+/**
+ * @brief Drop every cached FC03/FC04 response. Needed after uint_input_reg[] or uint_hold_reg[] was written directly,
+ * the cache only sees the changes made through the library.
+ * @param none
+ * @retval none
+ */
+void MBR_Invalidate_Cache(void)
 {
-	Reset_DE_Pin();
-
-	if(flg_reinit_modbus)	//XXX test it
+	for(uint32_t i = 0; i < RESPONSE_CACHE; i++)
 	{
-		flg_reinit_modbus = 0;
-		Update_Communication_Parameters();
+		response_cache[i].frame_size = 0;
 	}
 }
+#endif
 
-
-/*PRIVATE FUNCTIONS*/
-static uint16_t Calculate_CRC16(uint8_t *buf, uint16_t len)
+#if FIFO_COUNT
+/**
+ * @brief Append the value to the FIFO read with FC24. Lock-free: one producer (e.g. a timer interrupt) per FIFO.
+ * @param fifo_number 0..FIFO_COUNT-1, FC24 pointer address FIFO_ADDRESS+fifo_number
+ * @param value the sample
+ * @retval 0 = ok, 1 = the FIFO is full (the value is dropped) or does not exist
+ */
+uint8_t MBR_FIFO_Push(uint8_t fifo_number, uint16_t value)
 {
-	static const uint16_t crc_table[] = {
-			0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
-			0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
-			0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
-			0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
-			0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
-			0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
-			0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
-			0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
-			0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
-			0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
-			0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
-			0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
-			0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
-			0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
-			0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
-			0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
-			0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
-			0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
-			0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
-			0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
-			0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
-			0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
-			0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
-			0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
-			0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
-			0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
-			0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
-			0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
-			0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
-			0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
-			0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
-			0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040};
+	struct fifo_s *fifo;
+	uint16_t head;
 
-	uint8_t xor;
-	uint16_t crc = 0xFFFF;
-
-	while(len--)
+	if(fifo_number >= FIFO_COUNT)
 	{
-		xor = *buf++ ^ crc;
-		crc >>= 8;
-		crc ^= crc_table[xor];
+		return 1;
 	}
+	fifo = &modbus_fifo[fifo_number];
+	head = fifo->head;
 
-	return crc;
+	if((uint16_t)(head - fifo->tail) >= FIFO_SIZE)
+	{
+		return 1;
+	}
+	fifo->value[head % FIFO_SIZE] = value;
+	__DMB();	//the value is stored before it is published
+	fifo->head = head + 1;
+	return 0;
 }
+#endif
 
+#if TRAFFIC_STATISTICS
+/**
+ * @brief Get the traffic counters and the turnaround histogram.
+ * @param none
+ * @retval pointer to the statistics
+ */
+const struct structTrafficStats *MBR_Get_Traffic_Stats(void)
+{
+	return &traffic_stats;
+}
 
-static void Check_Frame(void)
+/**
+ * @brief Get the turnaround time percentile from the histogram.
+ * @param permille percentile in 1/1000, e.g. 500 = median, 999 = p99.9
+ * @retval upper bound of the histogram bucket in us, 0 when no response was sent yet
+ */
+uint32_t MBR_Get_Latency_Percentile(uint16_t permille)
 {
-	uint16_t crc_int;
+	uint32_t total = 0, sum = 0;
+	uint32_t bucket;
 
-	crc_int = (buf_modbus[len_modbus_frame-1]<<8) + buf_modbus[len_modbus_frame-2];	//get CRC16 bytes from the received packet
+	for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		total += traffic_stats.latency[bucket];
+	}
+	if(total == 0)
+	{
+		return 0;
+	}
 
-	if(crc_int == Calculate_CRC16(buf_modbus,(len_modbus_frame-2)))	// Check does the CRC match
+	for(bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
 	{
-		if ((buf_modbus[0] == uint_hold_reg[0]) || buf_modbus[0] == 0x00)	//Check if the device address is correct
+		sum += traffic_stats.latency[bucket];
+		if((uint64_t)sum * 1000 >= (uint64_t)total * permille)
 		{
-			Process_Request();	// Return flag OK;
-			flg_modbus_no_comm = 0;
-			cnt_modbus_no_comm = 0;
+			break;
 		}
 	}
+
+	if(bucket < 4)
+	{
+		return bucket;
+	}
+	return ((4 + bucket%4 + 1) << (bucket/4 - 1)) - 1;
 }
 
-static void Read_Input_Registers(struct response_s *response_s)
+/**
+ * @brief Clear all traffic counters.
+ * @param none
+ * @retval none
+ */
+void MBR_Reset_Traffic_Stats(void)
 {
-	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t register_count, crc16;
+	traffic_stats = (struct structTrafficStats){0};
+}
+#endif
 
-	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
-	buf_modbus[2] = register_count*2;	// byte count
+#if W_REG_COUNT
+/**
+ * @brief Update both words of the 32-bit register in EEPROM and in the buffer.
+ * @param wide_number index in RegWide[]
+ * @param value new value in the type of the register
+ * @retval none
+ */
+void MBR_Rewrite_Wide_Register(uint16_t wide_number, union unionWide value)
+{
+	const struct structHRWide *wide = &RegWide[wide_number];
+	uint16_t high_word = value.u32>>16;
+	uint16_t low_word = value.u32;
 
-	if(register_count + start_address > I_REG_COUNT)
+	if(wide->wordOrder == wide_high_word_first)
 	{
-		response_s->exception = 0x02;
+		Update_Wide_Data(wide, high_word, low_word);
 	}
 	else
 	{
-		for(uint32_t i = start_address; i < start_address + register_count; i++)
-		{
-			buf_modbus[3+(i-start_address)*2] = (uint_input_reg[i]>>8);
-			buf_modbus[4+(i-start_address)*2] = uint_input_reg[i];
-		}
-
-		crc16 = Calculate_CRC16(buf_modbus,3+buf_modbus[2]);
-		buf_modbus[3+buf_modbus[2]] = crc16;	// CRC Lo byte
-		buf_modbus[4+buf_modbus[2]] = crc16>>8;	// CRC Hi byte
+		Update_Wide_Data(wide, low_word, high_word);
 	}
+}
 
-	response_s->frame_size = 5 + buf_modbus[2];
+/**
+ * @brief Set the handler that stores both words of a 32-bit register in one step, so a reset can not leave a torn value
+ *        in EEPROM. Call before MBR_Init_Modbus(). Without it the words are stored with two calls of the write handler.
+ * @param write_pair_handler uint8_t handler(uint16_t first_address, uint16_t first_data, uint16_t second_address, uint16_t second_data),
+ *        virtual addresses as for the write handler, e.g. MBR_Journal_Write_Pair
+ * @retval none
+ */
+void MBR_Init_Wide_Write(void *write_pair_handler)
+{
+	Write_Pair_Dummy = write_pair_handler;
 }
 
-static void Read_Holding_Registers(struct response_s *response_s)
+/**
+ * @brief Get the value of the 32-bit register.
+ * @param wide_number index in RegWide[]
+ * @retval value in the type of the register
+ */
+union unionWide MBR_Get_Wide_Register(uint16_t wide_number)
 {
-	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t register_count, crc16;
+	const struct structHRWide *wide = &RegWide[wide_number];
+
+	return Join_Wide_Words(wide, uint_hold_reg[wide->index], uint_hold_reg[wide->index+1]);
+}
+#endif
+
+#if PERSISTENT_JOURNAL
+/**
+ * @brief Read the register value from the journal, read handler for MBR_Init_Modbus().
+ * @param register_number index in uint_hold_reg[], or MBR_FIRST_START_PROBE
+ * @param data the value
+ * @retval 0 = ok, 1 = the register has no value in the journal (MBR_FIRST_START_PROBE: the journal is empty)
+ */
+uint8_t MBR_Journal_Read(uint16_t register_number, uint16_t *data)
+{
+	Journal_Init();
+
+	if(register_number == MBR_FIRST_START_PROBE)
+	{
+		for(uint32_t i = 0; i < sizeof(journal_valid); i++)
+		{
+			if(journal_valid[i])
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	if(register_number >= H_REG_COUNT || !MAP_TEST(journal_valid, register_number))
+	{
+		return 1;
+	}
+
+	*data = journal_value[register_number];
+	return 0;
+}
+
+/**
+ * @brief Read the register value from the journal by its virtual address.
+ * @param address virtual address from RegVirtAddr[]
+ * @param data the value
+ * @retval 0 = ok, 1 = unknown virtual address or the register has no value in the journal
+ */
+uint8_t MBR_Journal_Read_Address(uint16_t address, uint16_t *data)
+{
+	Journal_Init();
+
+	return MBR_Journal_Read(Journal_Find_Register(address), data);
+}
+
+/**
+ * @brief Store the register value. The value is readable at once and the record is programmed by MBR_Journal_Flush(),
+ *        the call never waits for flash (FC16 of 123 registers only marks them).
+ * @param address virtual address from RegVirtAddr[]
+ * @param data the value
+ * @retval 0 = ok, 1 = unknown virtual address
+ */
+uint8_t MBR_Journal_Write(uint16_t address, uint16_t data)
+{
+	uint16_t index;
+
+	Journal_Init();
+
+	index = Journal_Find_Register(address);
+	if(index >= H_REG_COUNT)
+	{
+		return 1;
+	}
+
+	if(MAP_TEST(journal_valid, index) && (journal_value[index] == data))	//nothing to store
+	{
+		return 0;
+	}
+
+	journal_value[index] = data;
+	MAP_SET(journal_valid, index);
+	MAP_SET(journal_dirty, index);
+	return 0;
+}
+
+#if W_REG_COUNT
+/**
+ * @brief Store both words of a 32-bit value, pass it to MBR_Init_Wide_Write(). The two records are programmed together,
+ *        a reset between them leaves the previous value of both words.
+ * @param first_address virtual address of the first word (RegWide[].index)
+ * @param first_data the first word
+ * @param second_address virtual address of the second word
+ * @param second_data the second word
+ * @retval 0 = ok, 1 = unknown virtual address or the registers are not consecutive
+ */
+uint8_t MBR_Journal_Write_Pair(uint16_t first_address, uint16_t first_data, uint16_t second_address, uint16_t second_data)
+{
+	uint16_t first, second;
+
+	Journal_Init();
+
+	first = Journal_Find_Register(first_address);
+	second = Journal_Find_Register(second_address);
+	if(first >= H_REG_COUNT || second != first + 1)
+	{
+		return 1;
+	}
+
+	journal_value[first] = first_data;
+	journal_value[second] = second_data;
+	MAP_SET(journal_valid, first);
+	MAP_SET(journal_valid, second);
+	MAP_SET(journal_dirty, first);
+	MAP_SET(journal_dirty, second);
+	return 0;
+}
+#endif
+
+/**
+ * @brief Program up to JOURNAL_PROGRAM_STEP changed registers into the active page, or run one step of the compaction.
+ *        A failed program leaves the register marked, the page is then compacted into the next one.
+ * @param none
+ * @retval none
+ */
+void MBR_Journal_Flush(void)
+{
+	uint32_t page_address;
+	uint16_t index, count, programmed = 0;
+
+	Journal_Init();
+
+	if(idx_journal_copy != JOURNAL_NO_COMPACTION)
+	{
+		Journal_Compaction_Step();
+		return;
+	}
+
+	page_address = JOURNAL_BASE_ADDRESS + idx_journal_page*FLASH_PAGE_SIZE;
+
+	HAL_FLASH_Unlock();
+	for(uint32_t i = 0; i < H_REG_COUNT && programmed < JOURNAL_PROGRAM_STEP; i++)
+	{
+		if(!MAP_TEST(journal_dirty, i))
+		{
+			continue;
+		}
+
+		index = i;
+		count = Journal_Record_Count(&index);
+		if(ofs_journal_write + 4u*count > FLASH_PAGE_SIZE)	//active page is full
+		{
+			HAL_FLASH_Lock();
+			Journal_Start_Compaction();
+			return;
+		}
+		if(Journal_Append(page_address, index, count))	//the page holds a broken record: move the live values to the next page
+		{
+			ofs_journal_write = FLASH_PAGE_SIZE;
+			break;
+		}
+		for(uint32_t j = index; j < index + count; j++)
+		{
+			MAP_CLEAR(journal_dirty, j);
+		}
+		programmed += count;
+		i = index + count - 1;
+	}
+	HAL_FLASH_Lock();
+}
+#endif
+
+#if HANDLER_PROFILING
+/**
+ * @brief Get execution time statistics of the request handler.
+ * @param handler one of the profiled_handler_e values
+ * @retval pointer to the statistics or NULL when handler is out of range
+ */
+const struct structHandlerStats *MBR_Get_Handler_Stats(uint8_t handler)
+{
+	if(handler >= profile_count)
+	{
+		return NULL;
+	}
+	return &handler_stats[handler];
+}
+
+/**
+ * @brief Clear execution time statistics of all request handlers.
+ * @param none
+ * @retval none
+ */
+void MBR_Reset_Handler_Stats(void)
+{
+	for(uint32_t i = 0; i < profile_count; i++)
+	{
+		handler_stats[i] = (struct structHandlerStats){0, 0, 0, 0, 0};
+	}
+}
+#endif
+
+
+/*CALLBACKS*/
+/**
+ * @brief This function is called every time when DE pin state changes.
+ * @param none
+ * @retval none
+ */
+__weak void MBR_Switch_DE_Callback(uint8_t state)
+{
+	UNUSED(state);	//can be ommited in C2X
+}
+
+/**
+ * @brief This function is called every time when Modbus master tries to update holding register value.
+ * @param none
+ * @retval 0 = ok (new value is allowed), 1 = not ok (new value is not allowed)
+ */
+__weak uint8_t MBR_Check_Restrictions_Callback(uint16_t register_address, uint16_t register_data)
+{
+	UNUSED(register_address);
+	UNUSED(register_data);
+	return 0;
+}
+
+/**
+ * @brief This function is called when holding register value has been updated.
+ * @param none
+ * @retval none
+ */
+__weak void MBR_Register_Update_Callback(uint16_t register_address, uint16_t register_data)
+{
+	UNUSED(register_address);
+	UNUSED(register_data);
+}
+
+
+/*HAL CALLBACKS*/
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	UNUSED(huart);
+	flg_modbus_packet_received = 1;
+#if (TRAFFIC_STATISTICS || BUS_CAPTURE) && !RX_CIRCULAR_DMA
+	if(huart->ErrorCode == HAL_UART_ERROR_RTO)	//frame end, a noise or framing error in the middle of the frame does not move it
+	{
+#if TRAFFIC_STATISTICS
+		cyc_modbus_frame_end = Get_Cycle_Count();
+#endif
+#if BUS_CAPTURE
+		tick_modbus_frame_end = HAL_GetTick();	//the gaps of the capture do not include the main loop latency
+#endif
+	}
+#endif
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	UNUSED(huart);
+	Reset_DE_Pin();
+#if RX_CIRCULAR_DMA
+	flg_modbus_tx_busy = 0;
+#endif
+
+	if(flg_reinit_modbus)	//XXX test it
+	{
+		flg_reinit_modbus = 0;
+		Update_Communication_Parameters();
+	}
+
+#if FIRMWARE_TRANSFER
+	if(flg_fw_jump)
+	{
+		Firmware_Jump_To_Bootloader();
+	}
+#endif
+}
+
+
+/*PRIVATE FUNCTIONS*/
+static uint16_t Calculate_CRC16(uint8_t *buf, uint16_t len)
+{
+	return Update_CRC16(0xFFFF, buf, len);
+}
+
+static uint16_t Update_CRC16(uint16_t crc, uint8_t *buf, uint16_t len)
+{
+#if COMPACT_CRC_TABLE
+	static const uint16_t crc_table[16] = {
+			0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+			0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400};
+
+	while(len--)
+	{
+		crc ^= *buf++;
+		crc = (crc>>4) ^ crc_table[crc & 0x0F];
+		crc = (crc>>4) ^ crc_table[crc & 0x0F];
+	}
+#else
+	static const uint16_t crc_table[] = {
+			0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
+			0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
+			0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
+			0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
+			0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
+			0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
+			0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
+			0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
+			0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
+			0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
+			0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
+			0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
+			0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
+			0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
+			0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
+			0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
+			0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
+			0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
+			0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
+			0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
+			0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
+			0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
+			0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
+			0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
+			0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
+			0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
+			0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
+			0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
+			0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
+			0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
+			0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
+			0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040};
+
+	uint8_t xor;
+
+	while(len--)
+	{
+		xor = *buf++ ^ crc;
+		crc >>= 8;
+		crc ^= crc_table[xor];
+	}
+#endif
+
+	return crc;
+}
+
+
+/*the shortest request has 8 bytes, FC24 and some vendor function codes are shorter, sub_command is the third byte*/
+static uint8_t Check_Frame_Length(uint8_t function_code, uint8_t sub_command, uint16_t length)
+{
+	uint16_t minimum = 8;
+
+	UNUSED(sub_command);	//FC68 only
+
+	switch(function_code)
+	{
+#if FIFO_COUNT
+	case read_fifo_queue:
+		return length == 6;
+#endif
+#if BUS_CAPTURE
+	case read_bus_capture:	//address, function code, CRC
+		minimum = 4;
+		break;
+#endif
+#if FIRMWARE_TRANSFER
+	case firmware_transfer:
+		switch(sub_command)
+		{
+		case fw_start:	//address, function code, sub-command, image size, CRC
+		case fw_finish:	//address, function code, sub-command, CRC32, CRC
+			return length == 9;
+		case fw_data:	//address, function code, sub-command, block number, flags, 1..FW_BLOCK_SIZE bytes, CRC
+			return length >= 9 && length <= 8 + FW_BLOCK_SIZE;
+		case fw_status:	//address, function code, sub-command, CRC
+			return length == 5;
+		default:	//answered with exception 03
+			minimum = 5;
+			break;
+		}
+		break;
+#endif
+#if DELTA_READ
+	case read_changed_registers:	//address, function code, bank, epoch, version, CRC
+		return length == 9;
+#endif
+	case 105:	//UID search: address, function code, prefix length, UID 12 bytes, CRC
+		return length == 17;
+	default:
+		break;
+	}
+	return length >= minimum && length <= MODBUS_BUFFER_SIZE;
+}
+
+#if !RX_CIRCULAR_DMA
+static void Check_Frame(void)
+{
+	uint16_t crc_int;
+
+	crc_int = (buf_modbus[len_modbus_frame-1]<<8) + buf_modbus[len_modbus_frame-2];	//get CRC16 bytes from the received packet
+
+	if(crc_int == Calculate_CRC16(buf_modbus,(len_modbus_frame-2)))	// Check does the CRC match
+	{
+		if ((buf_modbus[0] == uint_hold_reg[0]) || buf_modbus[0] == 0x00)	//Check if the device address is correct
+		{
+			Process_Request();	// Return flag OK;
+			flg_modbus_no_comm = 0;
+			cnt_modbus_no_comm = 0;
+		}
+	}
+#if TRAFFIC_STATISTICS
+	else
+	{
+		traffic_stats.crc_errors++;
+	}
+#endif
+}
+#endif
+
+#if RX_CIRCULAR_DMA
+/*the DMA write position is the end of the frame*/
+static void Queue_Ring_Frame(void)
+{
+	uint16_t position, next_head;
+
+	position = RX_RING_SIZE - modbus_huart->hdmarx->Instance->CNDTR;
+	if(position == RX_RING_SIZE)
+	{
+		position = 0;
+	}
+	if(position == ofs_rx_frame_start)
+	{
+		return;
+	}
+
+	next_head = (idx_rx_queue_head + 1) % RX_QUEUE_SIZE;
+	if(next_head == idx_rx_queue_tail)
+	{
+		cnt_rx_dropped++;
+#if TRAFFIC_STATISTICS
+		traffic_stats.dropped++;
+#endif
+	}
+	else
+	{
+		rx_queue[idx_rx_queue_head].offset = ofs_rx_frame_start;
+		rx_queue[idx_rx_queue_head].length = (position + RX_RING_SIZE - ofs_rx_frame_start) % RX_RING_SIZE;
+		rx_queue[idx_rx_queue_head].tick = HAL_GetTick();
+#if TRAFFIC_STATISTICS
+		rx_queue[idx_rx_queue_head].cycle = Get_Cycle_Count();
+#endif
+		idx_rx_queue_head = next_head;
+	}
+	ofs_rx_frame_start = position;
+}
+
+/*the frame is checked in the ring, only a request for this device is copied to buf_modbus*/
+static void Check_Ring_Frame(struct frame_s *frame)
+{
+	uint16_t first_part, crc16, crc_int;
+	uint16_t payload_length = frame->length - 2;
+
+#if TRAFFIC_STATISTICS
+	traffic_stats.frames++;
+#endif
+#if BUS_CAPTURE
+	Capture_Frame(buf_modbus_rx, RX_RING_SIZE, frame->offset, frame->length, frame->tick);
+#endif
+
+	if(!Check_Frame_Length(buf_modbus_rx[(frame->offset + 1) % RX_RING_SIZE], buf_modbus_rx[(frame->offset + 2) % RX_RING_SIZE], frame->length))
+	{
+		return;
+	}
+
+	if((buf_modbus_rx[frame->offset] != uint_hold_reg[0]) && (buf_modbus_rx[frame->offset] != 0x00))	//Check if the device address is correct
+	{
+		return;
+	}
+
+	first_part = RX_RING_SIZE - frame->offset;	//bytes before the wraparound
+	if(first_part > payload_length)
+	{
+		first_part = payload_length;
+	}
+	crc16 = Update_CRC16(0xFFFF, &buf_modbus_rx[frame->offset], first_part);
+	crc16 = Update_CRC16(crc16, buf_modbus_rx, payload_length - first_part);
+
+	crc_int = (buf_modbus_rx[(frame->offset + frame->length - 1) % RX_RING_SIZE]<<8) + buf_modbus_rx[(frame->offset + frame->length - 2) % RX_RING_SIZE];
+	if(crc_int != crc16)
+	{
+#if TRAFFIC_STATISTICS
+		traffic_stats.crc_errors++;
+#endif
+		return;
+	}
+
+	for(uint32_t i = 0; i < frame->length; i++)
+	{
+		buf_modbus[i] = buf_modbus_rx[(frame->offset + i) % RX_RING_SIZE];
+	}
+	len_modbus_frame = frame->length;
+#if TRAFFIC_STATISTICS
+	cyc_modbus_frame_end = frame->cycle;
+#endif
+
+	Process_Request();
+	flg_modbus_no_comm = 0;
+	cnt_modbus_no_comm = 0;
+}
+#endif
+
+static void Read_Input_Registers(struct response_s *response_s)
+{
+	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
+	uint16_t register_count, crc16;
+#if RESPONSE_CACHE
+	uint16_t version = input_version;	//taken before encoding: a change during encoding leaves the cached copy stale
+#endif
+
+	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
+
+	if(register_count == 0 || register_count > MAX_READ_REGISTERS)
+	{
+		response_s->exception = 0x03;
+		return;
+	}
+#if RESPONSE_CACHE
+	if(Use_Cached_Response(response_s, start_address, register_count, version))
+	{
+		return;
+	}
+#endif
+
+	response_s->exception = Encode_Input_Registers(start_address, register_count, &buf_modbus[3]);
+	if(response_s->exception == 0)
+	{
+		buf_modbus[2] = register_count*2;	// byte count
+		crc16 = Calculate_CRC16(buf_modbus,3+buf_modbus[2]);
+		buf_modbus[3+buf_modbus[2]] = crc16;	// CRC Lo byte
+		buf_modbus[4+buf_modbus[2]] = crc16>>8;	// CRC Hi byte
+		response_s->frame_size = 5 + buf_modbus[2];
+#if RESPONSE_CACHE
+		Cache_Response(response_s->frame_size, start_address, register_count, version);
+#endif
+	}
+}
+
+static void Read_Holding_Registers(struct response_s *response_s)
+{
+	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
+	uint16_t register_count, crc16;
+#if RESPONSE_CACHE
+	uint16_t version = hold_version;	//taken before encoding: an update during encoding leaves the cached copy stale
+#endif
+
+	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
+
+	if(start_address == 0 && register_count == 4)
+	{
+		response_s->flg_response = 1;
+	}
+
+	if(register_count == 0 || register_count > MAX_READ_REGISTERS)
+	{
+		response_s->exception = 0x03;
+		return;
+	}
+#if RESPONSE_CACHE
+	if(Use_Cached_Response(response_s, start_address, register_count, version))
+	{
+		return;
+	}
+#endif
+
+	response_s->exception = Encode_Holding_Registers(start_address, register_count, &buf_modbus[3]);
+	if(response_s->exception == 0)
+	{
+		buf_modbus[2] = register_count*2;	// byte count
+		crc16 = Calculate_CRC16(buf_modbus,3+buf_modbus[2]);
+		buf_modbus[3+buf_modbus[2]] = crc16;	// CRC Lo byte
+		buf_modbus[4+buf_modbus[2]] = crc16>>8;	// CRC Hi byte
+		response_s->frame_size = 5 + buf_modbus[2];
+#if RESPONSE_CACHE
+		Cache_Response(response_s->frame_size, start_address, register_count, version);
+#endif
+	}
+}
+
+#if RESPONSE_CACHE
+/*
+ * Cached responses are looked up with the address and the function code of the request in buf_modbus. An entry is
+ * current while the version of its bank is unchanged, the frame is sent from the entry as it is (with the CRC).
+ */
+static uint8_t Use_Cached_Response(struct response_s *response_s, uint16_t start_address, uint16_t register_count, uint16_t version)
+{
+	for(uint32_t i = 0; i < RESPONSE_CACHE; i++)
+	{
+		struct cache_entry_s *entry = &response_cache[i];
+
+		if(entry->frame_size && entry->version == version && entry->start_address == start_address
+				&& entry->register_count == register_count && entry->frame[0] == buf_modbus[0] && entry->frame[1] == buf_modbus[1])
+		{
+			response_s->frame = entry->frame;
+			response_s->frame_size = entry->frame_size;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*keeps the response in buf_modbus, a stale entry of the same request is reused*/
+static void Cache_Response(uint16_t frame_size, uint16_t start_address, uint16_t register_count, uint16_t version)
+{
+	struct cache_entry_s *entry = NULL;
+
+	if(frame_size > CACHE_FRAME_SIZE)
+	{
+		return;
+	}
+
+	for(uint32_t i = 0; i < RESPONSE_CACHE && entry == NULL; i++)
+	{
+		if(response_cache[i].frame_size && response_cache[i].start_address == start_address
+				&& response_cache[i].register_count == register_count && response_cache[i].frame[0] == buf_modbus[0] && response_cache[i].frame[1] == buf_modbus[1])
+		{
+			entry = &response_cache[i];
+		}
+	}
+	if(entry == NULL)
+	{
+		entry = &response_cache[idx_cache_victim];
+		idx_cache_victim = (idx_cache_victim + 1) % RESPONSE_CACHE;
+	}
+
+	for(uint32_t i = 0; i < frame_size; i++)
+	{
+		entry->frame[i] = buf_modbus[i];
+	}
+	entry->start_address = start_address;
+	entry->register_count = register_count;
+	entry->version = version;
+	entry->frame_size = frame_size;
+}
+#endif
+
+#if SCATTER_READ
+/*
+ * FC67 request:  [address][0x43][range count][ranges: bank (0=holding, 1=input), start address 2 bytes, register count][CRC]
+ * FC67 response: [address][0x43][byte count][values of all ranges in the request order][CRC]
+ * Every range is checked like FC03/FC04, all ranges together are limited to MAX_READ_REGISTERS registers.
+ */
+static void Read_Scattered_Registers(struct response_s *response_s)
+{
+	uint8_t ranges[4*SCATTER_MAX_RANGES];	//the request is overwritten by the response
+	uint8_t range_count = buf_modbus[2];
+	uint16_t start_address, register_count, crc16;
+	uint16_t total_count = 0;
+	uint16_t position = 3;
+
+	if(range_count == 0 || range_count > SCATTER_MAX_RANGES || len_modbus_frame != 5 + 4*range_count)
+	{
+		response_s->exception = 0x03;
+		return;
+	}
+
+	for(uint32_t i = 0; i < 4*range_count; i++)
+	{
+		ranges[i] = buf_modbus[3+i];
+	}
+	for(uint32_t i = 0; i < range_count; i++)
+	{
+		total_count += ranges[4*i+3];
+		if(ranges[4*i+3] == 0)
+		{
+			response_s->exception = 0x03;
+			return;
+		}
+	}
+	if(total_count > MAX_READ_REGISTERS)	//the response would not fit into one frame
+	{
+		response_s->exception = 0x03;
+		return;
+	}
+
+	for(uint32_t i = 0; i < range_count; i++)
+	{
+		start_address = (ranges[4*i+1]<<8) + ranges[4*i+2];
+		register_count = ranges[4*i+3];
+
+		switch(ranges[4*i])
+		{
+		case 0:
+			response_s->exception = Encode_Holding_Registers(start_address, register_count, &buf_modbus[position]);
+			break;
+		case 1:
+			response_s->exception = Encode_Input_Registers(start_address, register_count, &buf_modbus[position]);
+			break;
+		default:
+			response_s->exception = 0x02;
+		}
+		if(response_s->exception)
+		{
+			return;
+		}
+		position += 2*register_count;
+	}
+
+	buf_modbus[2] = position - 3;	// byte count
+	crc16 = Calculate_CRC16(buf_modbus,position);
+	buf_modbus[position] = crc16;	// CRC Lo byte
+	buf_modbus[position+1] = crc16>>8;	// CRC Hi byte
+	response_s->frame_size = position + 2;
+}
+#endif
+
+#if FIFO_COUNT
+/*
+ * FC24 request:  [address][0x18][FIFO pointer address 2 bytes][CRC]
+ * FC24 response: [address][0x18][byte count 2 bytes][FIFO count 2 bytes][values, the oldest first][CRC]
+ * Up to MAX_FIFO_VALUES values are read and removed from the FIFO, the rest is left for the next request
+ * (the standard answers exception 03 when there are more than 31 values).
+ */
+static void Read_FIFO_Queue(struct response_s *response_s)
+{
+	uint16_t fifo_number = ((buf_modbus[2]<<8) + buf_modbus[3]) - FIFO_ADDRESS;
+	uint16_t tail, count, first_part, crc16;
+	struct fifo_s *fifo;
+
+	if(fifo_number >= FIFO_COUNT)
+	{
+		response_s->exception = 0x02;
+		return;
+	}
+	fifo = &modbus_fifo[fifo_number];
+
+	tail = fifo->tail;
+	count = fifo->head - tail;
+	if(count > MAX_FIFO_VALUES)
+	{
+		count = MAX_FIFO_VALUES;
+	}
+	if(!response_s->flg_response)	//broadcast: nothing is sent, nothing is removed
+	{
+		count = 0;
+	}
+	__DMB();	//the values are read after the head
+
+	first_part = FIFO_SIZE - tail % FIFO_SIZE;
+	if(first_part > count)
+	{
+		first_part = count;
+	}
+	Encode_Words(&fifo->value[tail % FIFO_SIZE], first_part, &buf_modbus[6]);
+	Encode_Words(&fifo->value[0], count - first_part, &buf_modbus[6 + 2*first_part]);
+
+	__DMB();	//the values are copied before their space is given back
+	fifo->tail = tail + count;
+
+	buf_modbus[2] = 0;	// byte count Hi byte
+	buf_modbus[3] = 2 + 2*count;	// byte count Lo byte
+	buf_modbus[4] = 0;	// FIFO count Hi byte
+	buf_modbus[5] = count;	// FIFO count Lo byte
+	crc16 = Calculate_CRC16(buf_modbus,6 + 2*count);
+	buf_modbus[6 + 2*count] = crc16;	// CRC Lo byte
+	buf_modbus[7 + 2*count] = crc16>>8;	// CRC Hi byte
+	response_s->frame_size = 8 + 2*count;
+}
+#endif
+
+/*writes count words as big-endian to dst, dst has no alignment (the data of a response starts at an odd offset)*/
+static void Encode_Words(const uint16_t *src, uint16_t count, uint8_t *dst)
+{
+	uint32_t i = 0;
+
+#if defined(__AVX2__)
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i words = _mm256_loadu_si256((const __m256i *)&src[i]);
+		_mm256_storeu_si256((__m256i *)&dst[2*i], _mm256_or_si256(_mm256_slli_epi16(words, 8), _mm256_srli_epi16(words, 8)));
+	}
+#endif
+#if defined(__SSE2__)
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i words = _mm_loadu_si128((const __m128i *)&src[i]);
+		_mm_storeu_si128((__m128i *)&dst[2*i], _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8)));
+	}
+#elif defined(__CORTEX_M) && defined(__ARM_FEATURE_UNALIGNED)
+	for(; i + 2 <= count; i += 2)	//REV16 swaps both halfwords of a word, LDR/STR take unaligned addresses (not Cortex-M0)
+	{
+		__UNALIGNED_UINT32_WRITE(&dst[2*i], __REV16(__UNALIGNED_UINT32_READ(&src[i])));
+	}
+#endif
+	for(; i < count; i++)
+	{
+		dst[2*i] = src[i]>>8;
+		dst[2*i+1] = src[i];
+	}
+}
+
+/*writes register_count input registers as big-endian words to dst, returns the exception code*/
+static uint8_t Encode_Input_Registers(uint16_t start_address, uint16_t register_count, uint8_t *dst)
+{
+	if(register_count + start_address > I_REG_COUNT)
+	{
+		return 0x02;
+	}
+
+	Encode_Words(&uint_input_reg[start_address], register_count, dst);
+	return 0;
+}
+
+/*writes register_count holding (or special) registers as big-endian words to dst, returns the exception code*/
+static uint8_t Encode_Holding_Registers(uint16_t start_address, uint16_t register_count, uint8_t *dst)
+{
+	uint16_t index;
+
+	if (start_address > 998 && start_address < 1010)
+	{
+		if(start_address + register_count > 1010)
+		{
+			return 0x02;
+		}
+
+		Encode_Words(&uint_spec_reg[start_address-999], register_count, dst);
+		return 0;
+	}
+
+	if(Find_Holding_Registers(start_address, register_count, &index))
+	{
+		return 0x02;
+	}
+
+	Encode_Words(&uint_hold_reg[index], register_count, dst);	//the whole block is contiguous in uint_hold_reg[]
+	return 0;
+}
+
+static void Write_Multiple_Registers(struct response_s *response_s)
+{
+	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
+	uint16_t register_count, crc16;
+	uint16_t reg_data;
+	uint16_t index;
+
+	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
+
+	if(register_count == 0 || register_count > MAX_WRITE_REGISTERS)
+	{
+		response_s->exception = 0x03;
+		return;
+	}
+	if(Find_Holding_Registers(start_address, register_count, &index))
+	{
+		response_s->exception = 0x02;
+		return;
+	}
+	if((buf_modbus[6] != register_count*2) || (buf_modbus[6] != len_modbus_frame-9))	//buffer[6] - byte count: 7 bytes - header, 2 bytes - CRC
+	{
+		response_s->exception = 0x03;
+		return;
+	}
+
+	for(uint32_t i = index; i < index + register_count; i++)	//validate the whole request before anything is written
+	{
+		if(Is_Writable(i))
+		{
+			reg_data = (buf_modbus[7+(i-index)*2]<<8) + buf_modbus[8+(i-index)*2];
+#if W_REG_COUNT
+			const struct structHRWide *wide = Find_Wide_Register(i);
+			if(wide)
+			{
+				if((wide->index != i) || (i+1 >= index + register_count))	//only one word of the 32-bit value
+				{
+					response_s->exception = 0x02;
+					return;
+				}
+				uint16_t second_word = (buf_modbus[9+(i-index)*2]<<8) + buf_modbus[10+(i-index)*2];
+				if(Check_Wide_Value(wide, reg_data, second_word) || MBR_Check_Restrictions_Callback(i, reg_data) || MBR_Check_Restrictions_Callback(i+1, second_word))
+				{
+					response_s->exception = 0x03;
+					return;
+				}
+				i++;	//the second word is already checked
+				continue;
+			}
+#endif
+			response_s->exception = Check_Register_Value(i, reg_data);
+			if(response_s->exception)
+			{
+				return;
+			}
+		}
+	}
+
+	for(uint32_t i = index; i < index + register_count; i++)//write the new data;
+	{
+		if(Is_Writable(i))
+		{
+			reg_data = (buf_modbus[7+(i-index)*2]<<8) + buf_modbus[8+(i-index)*2];
+#if W_REG_COUNT
+			const struct structHRWide *wide = Find_Wide_Register(i);
+			if(wide)	//the request always has both words (checked above)
+			{
+				Update_Wide_Data(wide, reg_data, (buf_modbus[9+(i-index)*2]<<8) + buf_modbus[10+(i-index)*2]);
+				i++;
+				continue;
+			}
+#endif
+			Update_Data(i, reg_data);
+		}
+	}
+
+	crc16 = Calculate_CRC16(buf_modbus,6);
+	buf_modbus[6] = crc16;								// CRC Lo byte
+	buf_modbus[7] = crc16>>8;							// CRC Hi byte
+	response_s->frame_size = 8;
+
+	if(index < 3)
+	{
+		flg_reinit_modbus = 1;
+	}
+	else if((index<=8) && (index+register_count>8))
+	{
+		if(uint_hold_reg[8]) Set_NBT_Pin();
+		else Reset_NBT_Pin();
+	}
+	else if((index<=9) && (index+register_count>9))
+	{
+		Init_Default_Values(seting_values);
+	}
+}
+
+static void Write_Single_Register(struct response_s *response_s)
+{
+	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
+	uint16_t crc16;
+	uint16_t reg_data;
+	uint16_t index;
+
+	reg_data = (buf_modbus[4]<<8)+ buf_modbus[5];
+
+	if(start_address == 989 && reg_data == 1338)//go to BL
+	{
+		for(uint32_t i=0;i<0x10;i++)
+		{
+			buff_app_boot[i] = 138;
+		}
+		HAL_NVIC_SystemReset();
+	}
+
+	if(Find_Holding_Registers(start_address, 1, &index))
+	{
+		response_s->exception = 0x02;
+		return;
+	}
+
+#if W_REG_COUNT
+	if(Find_Wide_Register(index))	//a single word of the 32-bit value can not be written
+	{
+		response_s->exception = 0x02;
+		return;
+	}
+#endif
+
+	if(Is_Writable(index))//is register writable
+	{
+		response_s->exception = Check_Register_Value(index, reg_data);
+		if(response_s->exception)
+		{
+			return;
+		}
+		Update_Data(index, reg_data);
+	}
+
+	buf_modbus[4] = reg_data>>8;	//Register value 1st byte
+	buf_modbus[5] = reg_data;	//Register value 2nd byte
+	crc16 = Calculate_CRC16(buf_modbus,6);
+	buf_modbus[6] = crc16;	//CRC Lo byte
+	buf_modbus[7] = crc16>>8;	//CRC Hi byte
+	response_s->frame_size = 8;
+
+	if(index < 3)
+	{
+		flg_reinit_modbus = 1;
+	}
+	else if(index == 8)
+	{
+		if(uint_hold_reg[8]) Set_NBT_Pin();
+		else Reset_NBT_Pin();
+	}
+	else if(index == 9)
+	{
+		Init_Default_Values(seting_values);
+	}
+}
+
+/**
+ * @brief Translate Modbus holding register address to the index in uint_hold_reg[] and RegVirtAddr[].
+ * @note  The whole block [start_address, start_address+register_count) must lie in one run,
+ *        so the caller can stream uint_hold_reg[index...] sequentially.
+ * @retval 0 = ok, 1 = at least one address of the block is not mapped
+ */
+static uint8_t Find_Holding_Registers(uint16_t start_address, uint16_t register_count, uint16_t *index)
+{
+#if SPARSE_REG_MAP
+	uint16_t low = 0;
+	uint16_t high = H_RANGE_COUNT;
+	uint16_t middle;
+
+	while(low < high)	//find the first run that starts after start_address
+	{
+		middle = (low + high) / 2;
+		if(RegRanges[middle].startAddress <= start_address)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if(low == 0)
+	{
+		return 1;
+	}
+
+	const struct structHRRange *range = &RegRanges[low-1];
+	if((uint32_t)start_address + register_count > (uint32_t)range->startAddress + range->count)
+	{
+		return 1;
+	}
+	*index = range->index + (start_address - range->startAddress);
+#else
+	if((uint32_t)start_address + register_count > H_REG_COUNT)
+	{
+		return 1;
+	}
+	*index = start_address;
+#endif
+	return 0;
+}
+
+/*RW == 0 in RegVirtAddr[], one bit of the generated mask with COMPILED_REG_MAP*/
+static uint8_t Is_Writable(uint16_t index)
+{
+#if COMPILED_REG_MAP
+	return (RegChecks.writable[index / 32] >> (index % 32)) & 1;
+#else
+	return RegVirtAddr[index].RW == 0;
+#endif
+}
+
+/**
+ * @brief Check the new value of the writable holding register against its limits and the application restrictions.
+ * @retval 0 = ok, 0x03 = illegal data value
+ */
+static uint8_t Check_Register_Value(uint16_t index, uint16_t reg_data)
+{
+#if COMPILED_REG_MAP
+	if(((RegChecks.ranged[index / 32] >> (index % 32)) & 1) && RegChecks.check_value[index](reg_data))	//full range registers have no check
+	{
+		return 0x03;
+	}
+#else
+	if(RegVirtAddr[index].signedUnsigned)	//signed
+	{
+		if(((int16_t)reg_data < (int16_t)RegVirtAddr[index].Minimum) || ((int16_t)RegVirtAddr[index].Maximum < (int16_t)reg_data))
+		{
+			return 0x03;	//exceptions when the data is outside of the limits
+		}
+	}
+	else	//unsigned
+	{
+		if((reg_data < RegVirtAddr[index].Minimum) || (RegVirtAddr[index].Maximum < reg_data))
+		{
+			return 0x03;	//exceptions when the data is outside of the limits
+		}
+	}
+#endif
+
+	if(MBR_Check_Restrictions_Callback(index, reg_data))
+	{
+		return 0x03;
+	}
+
+	return 0;
+}
+
+#if W_REG_COUNT
+/**
+ * @brief Find the 32-bit register that occupies uint_hold_reg[index].
+ * @retval descriptor from RegWide[] or NULL for plain 16-bit registers
+ */
+static const struct structHRWide *Find_Wide_Register(uint16_t index)
+{
+	for(uint32_t i = 0; i < W_REG_COUNT; i++)
+	{
+		if((index == RegWide[i].index) || (index == RegWide[i].index + 1))
+		{
+			return &RegWide[i];
+		}
+	}
+	return NULL;
+}
+
+static union unionWide Join_Wide_Words(const struct structHRWide *wide, uint16_t first_word, uint16_t second_word)
+{
+	union unionWide value;
+
+	if(wide->wordOrder == wide_high_word_first)
+	{
+		value.u32 = ((uint32_t)first_word<<16) | second_word;
+	}
+	else
+	{
+		value.u32 = ((uint32_t)second_word<<16) | first_word;
+	}
+
+	return value;
+}
+
+/**
+ * @brief Check the 32-bit value against its limits.
+ * @retval 0 = ok, 0x03 = illegal data value
+ */
+static uint8_t Check_Wide_Value(const struct structHRWide *wide, uint16_t first_word, uint16_t second_word)
+{
+	union unionWide value = Join_Wide_Words(wide, first_word, second_word);
+	uint8_t flg_in_limits = 0;
+
+	switch(wide->type)
+	{
+	case wide_u32:
+		flg_in_limits = (wide->Minimum.u32 <= value.u32) && (value.u32 <= wide->Maximum.u32);
+		break;
+	case wide_i32:
+		flg_in_limits = (wide->Minimum.i32 <= value.i32) && (value.i32 <= wide->Maximum.i32);
+		break;
+	case wide_f32:
+		flg_in_limits = (wide->Minimum.f32 <= value.f32) && (value.f32 <= wide->Maximum.f32);	//false for NaN
+		break;
+	}
+
+	return flg_in_limits ? 0 : 0x03;
+}
+#endif
+
+
+#if BUS_CAPTURE
+/*
+ * Capture record: [tick 4 bytes][frame length 2 bytes][stored length 1 byte][first CAPTURE_SNAP_LENGTH frame bytes]
+ * All fields are big-endian. When the ring is full the oldest records are dropped.
+ */
+static void Capture_Put_Byte(uint8_t data)
+{
+	buf_capture[idx_capture_head] = data;
+	idx_capture_head = (idx_capture_head + 1) % CAPTURE_BUFFER_SIZE;
+}
+
+/*buf is a ring of size bytes, the frame starts at offset (0 for the linear buffer)*/
+static void Capture_Frame(uint8_t *buf, uint16_t size, uint16_t offset, uint16_t len, uint32_t tick)
+{
+	uint16_t stored_len, record_size;
+
+	if(len == 0)
+	{
+		return;
+	}
+
+	stored_len = (len < CAPTURE_SNAP_LENGTH) ? len : CAPTURE_SNAP_LENGTH;
+	record_size = CAPTURE_HEADER_SIZE + stored_len;
+
+	while(CAPTURE_BUFFER_SIZE - cnt_capture_used < record_size)	//drop the oldest records to free space
+	{
+		uint16_t oldest_size = CAPTURE_HEADER_SIZE + buf_capture[(idx_capture_tail + 6) % CAPTURE_BUFFER_SIZE];
+		idx_capture_tail = (idx_capture_tail + oldest_size) % CAPTURE_BUFFER_SIZE;
+		cnt_capture_used -= oldest_size;
+		cnt_capture_dropped++;
+	}
+
+	Capture_Put_Byte(tick>>24);
+	Capture_Put_Byte(tick>>16);
+	Capture_Put_Byte(tick>>8);
+	Capture_Put_Byte(tick);
+	Capture_Put_Byte(len>>8);
+	Capture_Put_Byte(len);
+	Capture_Put_Byte(stored_len);
+	for(uint32_t i = 0; i < stored_len; i++)
+	{
+		Capture_Put_Byte(buf[(offset + i) % size]);
+	}
+
+	cnt_capture_used += record_size;
+}
+
+/*
+ * FC65 request:  [address][0x41][CRC]
+ * FC65 response: [address][0x41][byte count][dropped records 2 bytes][whole capture records...][CRC]
+ * Drained records are removed from the ring, the dropped records counter is cleared after it was reported.
+ */
+static void Read_Bus_Capture(struct response_s *response_s)
+{
+	uint16_t crc16;
+	uint16_t byte_count = 2;
+	uint16_t record_size;
+
+	if(response_s->flg_response == 0)	//do not drain the ring with broadcast requests
+	{
+		return;
+	}
+
+	buf_modbus[3] = cnt_capture_dropped>>8;
+	buf_modbus[4] = cnt_capture_dropped;
+	cnt_capture_dropped = 0;
+
+	while(cnt_capture_used)
+	{
+		record_size = CAPTURE_HEADER_SIZE + buf_capture[(idx_capture_tail + 6) % CAPTURE_BUFFER_SIZE];
+		if(3 + byte_count + record_size + 2 > MODBUS_BUFFER_SIZE)	//the next record does not fit into this response
+		{
+			break;
+		}
+
+		for(uint32_t i = 0; i < record_size; i++)
+		{
+			buf_modbus[3+byte_count+i] = buf_capture[idx_capture_tail];
+			idx_capture_tail = (idx_capture_tail + 1) % CAPTURE_BUFFER_SIZE;
+		}
+		byte_count += record_size;
+		cnt_capture_used -= record_size;
+	}
+
+	buf_modbus[2] = byte_count;
+	crc16 = Calculate_CRC16(buf_modbus,3+byte_count);
+	buf_modbus[3+byte_count] = crc16;	// CRC Lo byte
+	buf_modbus[4+byte_count] = crc16>>8;	// CRC Hi byte
+	response_s->frame_size = 5 + byte_count;
+}
+#endif
+
+#if PERSISTENT_JOURNAL
+/*
+ * Journal layout: JOURNAL_PAGE_COUNT flash pages used round robin. The first word of a page is the header
+ * (JOURNAL_MAGIC | sequence number), the rest are records (register index << 16 | value) appended in order,
+ * the last record of a register wins. Both words of a 32-bit value are a pair of records, the first one is flagged
+ * with JOURNAL_PAIR_FIRST and counts only together with the next one. Writes only update the RAM index and mark
+ * the register in journal_dirty, MBR_Journal_Flush() programs the marked registers with their latest value.
+ * A full page is compacted into the next page: it is erased, the live values are copied from the RAM index
+ * JOURNAL_COPY_STEP records at a time, and the header is programmed last, so an interrupted compaction leaves
+ * the previous page active.
+ */
+static void Journal_Init(void)
+{
+	uint32_t page_address, header, record;
+	uint32_t pair_first = JOURNAL_ERASED;	//first record of a pair waiting for the second one
+	uint8_t flg_page_found = 0;
+
+	if(flg_journal_ready)
+	{
+		return;
+	}
+	flg_journal_ready = 1;
+	idx_journal_copy = JOURNAL_NO_COMPACTION;
+	Journal_Sort_Addresses();
+
+	for(uint32_t i = 0; i < JOURNAL_PAGE_COUNT; i++)	//the active page has the newest sequence number
+	{
+		header = *(volatile uint32_t*)(uintptr_t)(JOURNAL_BASE_ADDRESS + i*FLASH_PAGE_SIZE);
+		if((header & 0xFFFF0000) == JOURNAL_MAGIC)
+		{
+			if(!flg_page_found || (int16_t)((uint16_t)header - idx_journal_sequence) > 0)
+			{
+				idx_journal_page = i;
+				idx_journal_sequence = header;
+				flg_page_found = 1;
+			}
+		}
+	}
+
+	if(!flg_page_found)	//first startup: format the first page
+	{
+		FLASH_EraseInitTypeDef erase = {
+			.TypeErase = FLASH_TYPEERASE_PAGES,
+			.PageAddress = JOURNAL_BASE_ADDRESS,
+			.NbPages = 1,
+		};
+		uint32_t page_error;
+		HAL_StatusTypeDef status;
+
+		idx_journal_page = 0;
+		idx_journal_sequence = 0;
+		HAL_FLASH_Unlock();
+		status = HAL_FLASHEx_Erase(&erase, &page_error);
+		if(status == HAL_OK)
+		{
+			status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, JOURNAL_BASE_ADDRESS, JOURNAL_MAGIC);
+		}
+		HAL_FLASH_Lock();
+
+		ofs_journal_write = (status == HAL_OK) ? 4 : FLASH_PAGE_SIZE;	//a page that failed is left by the first flush
+		return;
+	}
+
+	page_address = JOURNAL_BASE_ADDRESS + idx_journal_page*FLASH_PAGE_SIZE;
+	for(ofs_journal_write = 4; ofs_journal_write < FLASH_PAGE_SIZE; ofs_journal_write += 4)	//replay the records
+	{
+		record = *(volatile uint32_t*)(uintptr_t)(page_address + ofs_journal_write);
+		if(record == JOURNAL_ERASED)
+		{
+			break;
+		}
+		if((record>>16) & JOURNAL_PAIR_FIRST)
+		{
+			pair_first = record & ~((uint32_t)JOURNAL_PAIR_FIRST<<16);
+			continue;
+		}
+		if(pair_first != JOURNAL_ERASED)	//a pair torn by a reset is dropped, the previous value of both words stays
+		{
+			if((record>>16) == (pair_first>>16) + 1)
+			{
+				Journal_Replay_Record(pair_first);
+			}
+			pair_first = JOURNAL_ERASED;
+		}
+		Journal_Replay_Record(record);
+	}
+}
+
+static void Journal_Replay_Record(uint32_t record)
+{
+	if((record>>16) < H_REG_COUNT)
+	{
+		journal_value[record>>16] = record;
+		MAP_SET(journal_valid, record>>16);
+	}
+}
+
+/*insertion sort, run once: registers with the same virtual address keep the order of RegVirtAddr[]*/
+static void Journal_Sort_Addresses(void)
+{
+	uint32_t j;
+
+	for(uint32_t i = 0; i < H_REG_COUNT; i++)
+	{
+		for(j = i; j > 0 && RegVirtAddr[journal_order[j-1]].virtualAddress > RegVirtAddr[i].virtualAddress; j--)
+		{
+			journal_order[j] = journal_order[j-1];
+		}
+		journal_order[j] = i;
+	}
+}
+
+/*binary search of journal_order: the first register with the virtual address in RegVirtAddr[], H_REG_COUNT when none has it*/
+static uint16_t Journal_Find_Register(uint16_t address)
+{
+	virt_addr_t key = address;
+	uint16_t low = 0;
+	uint16_t high = H_REG_COUNT;
+	uint16_t middle;
+
+	while(low < high)	//find the first register with the virtual address or a higher one
+	{
+		middle = (low + high) / 2;
+		if(RegVirtAddr[journal_order[middle]].virtualAddress < key)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if(low < H_REG_COUNT && RegVirtAddr[journal_order[low]].virtualAddress == key)
+	{
+		return journal_order[low];
+	}
+	return H_REG_COUNT;
+}
+
+/*number of records of the register: both words of a 32-bit value go together, index is moved to the first word*/
+static uint16_t Journal_Record_Count(uint16_t *index)
+{
+#if W_REG_COUNT
+	const struct structHRWide *wide = Find_Wide_Register(*index);
+
+	if(wide && MAP_TEST(journal_valid, wide->index) && MAP_TEST(journal_valid, wide->index+1))
+	{
+		*index = wide->index;
+		return 2;
+	}
+#else
+	UNUSED(index);
+#endif
+	return 1;
+}
+
+/*program the records of count registers from index at the write offset, the first word of a pair is flagged, returns 1 on a flash error*/
+static uint8_t Journal_Append(uint32_t page_address, uint16_t index, uint16_t count)
+{
+	uint32_t record;
+
+	for(uint32_t i = index; i < index + count; i++)
+	{
+		record = ((uint32_t)i<<16) | journal_value[i];
+		if(i + 1 < index + count)
+		{
+			record |= (uint32_t)JOURNAL_PAIR_FIRST<<16;
+		}
+		if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, page_address + ofs_journal_write, record) != HAL_OK)
+		{
+			return 1;
+		}
+		ofs_journal_write += 4;
+	}
+	return 0;
+}
+
+/*erase the next page, the copy starts with the next flush, a failed erase is tried again by the next flush*/
+static void Journal_Start_Compaction(void)
+{
+	uint16_t next_page = (idx_journal_page + 1) % JOURNAL_PAGE_COUNT;
+	FLASH_EraseInitTypeDef erase = {
+		.TypeErase = FLASH_TYPEERASE_PAGES,
+		.PageAddress = JOURNAL_BASE_ADDRESS + next_page*FLASH_PAGE_SIZE,
+		.NbPages = 1,
+	};
+	uint32_t page_error;
+	HAL_StatusTypeDef status;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &page_error);
+	HAL_FLASH_Lock();
+
+	if(status == HAL_OK)
+	{
+		idx_journal_copy = 0;
+		ofs_journal_write = 4;
+	}
+}
+
+/*copy the live values from RAM, they are the latest ones: the copied registers are no longer dirty*/
+static void Journal_Compaction_Step(void)
+{
+	uint16_t next_page = (idx_journal_page + 1) % JOURNAL_PAGE_COUNT;
+	uint32_t page_address = JOURNAL_BASE_ADDRESS + next_page*FLASH_PAGE_SIZE;
+	uint16_t index, count, copied = 0;
+
+	HAL_FLASH_Unlock();
+	while(idx_journal_copy < H_REG_COUNT && copied < JOURNAL_COPY_STEP)
+	{
+		if(!MAP_TEST(journal_valid, idx_journal_copy))
+		{
+			idx_journal_copy++;
+			continue;
+		}
+
+		index = idx_journal_copy;
+		count = Journal_Record_Count(&index);	//the first word of a pair comes first, both are copied in this step
+		if(Journal_Append(page_address, index, count))
+		{
+			HAL_FLASH_Lock();
+			Journal_Start_Compaction();	//start the copy again on a freshly erased page
+			return;
+		}
+		for(uint32_t j = index; j < index + count; j++)
+		{
+			MAP_CLEAR(journal_dirty, j);
+		}
+		copied += count;
+		idx_journal_copy = index + count;
+	}
+
+	if(idx_journal_copy == H_REG_COUNT)	//all live values are copied: activate the new page
+	{
+		if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, page_address, JOURNAL_MAGIC | (uint16_t)(idx_journal_sequence + 1)) != HAL_OK)
+		{
+			HAL_FLASH_Lock();
+			Journal_Start_Compaction();
+			return;
+		}
+		idx_journal_sequence++;
+		idx_journal_page = next_page;
+		idx_journal_copy = JOURNAL_NO_COMPACTION;
+	}
+	HAL_FLASH_Lock();
+}
+#endif
+
+#if DELTA_READ
+/*
+ * FC66 request:  [address][0x42][bank: 0=holding, 1=input][epoch 2 bytes][version 2 bytes][CRC]
+ * FC66 response: [address][0x42][byte count][bank][epoch 2 bytes][current version 2 bytes][flags][runs...][CRC]
+ * run: [start address 2 bytes][register count][values...]
+ * flags: 0 = registers changed after the given version, 1 = full snapshot (another epoch, the version is more than
+ * 32767 updates old or in the future), 2 = snapshot does not fit into one frame, read the bank with FC03/FC04.
+ * The versions restart at every reset, the epoch tells the master that they did: it is never 0 and changes with every
+ * reset, so a request with the epoch of the previous run is answered with a full snapshot. The master starts with
+ * epoch 0 (explicit full snapshot request) and keeps the returned epoch and version for the next poll.
+ */
+static void Read_Changed_Registers(struct response_s *response_s)
+{
+	uint8_t bank = buf_modbus[2];
+	uint16_t epoch = (buf_modbus[3]<<8) + buf_modbus[4];
+	uint16_t since = (buf_modbus[5]<<8) + buf_modbus[6];
+	uint16_t version, current_epoch, crc16;
+	uint16_t position;
+	uint32_t max_age;
+	uint8_t flags = 0;
+	uint8_t flg_overflow;
+
+	if(bank > 1)
+	{
+		response_s->exception = 0x02;
+		return;
+	}
+
+	current_epoch = Get_Delta_Epoch();	//also fixes the epoch when the first request asks for a full snapshot
+	version = (bank == 0) ? hold_version : input_version;
+	max_age = (uint16_t)(version - since);	//a register changed after since is younger than this
+	if(max_age >= 0x8000 || epoch != current_epoch)
+	{
+		flags = 1;
+		max_age = 0x10000;	//every register
+	}
+
+	flg_overflow = Encode_Changed_Bank(bank, version, max_age, &position);
+	if(flg_overflow && flags == 0)	//too many changes for one frame: send the full snapshot instead
+	{
+		flags = 1;
+		flg_overflow = Encode_Changed_Bank(bank, version, 0x10000, &position);
+	}
+	if(flg_overflow)
+	{
+		flags = 2;
+		position = DELTA_HEADER_SIZE;
+	}
+
+	buf_modbus[2] = position - 3;	// byte count
+	buf_modbus[3] = bank;
+	buf_modbus[4] = current_epoch>>8;
+	buf_modbus[5] = current_epoch;
+	buf_modbus[6] = version>>8;
+	buf_modbus[7] = version;
+	buf_modbus[8] = flags;
+	crc16 = Calculate_CRC16(buf_modbus,position);
+	buf_modbus[position] = crc16;	// CRC Lo byte
+	buf_modbus[position+1] = crc16>>8;	// CRC Hi byte
+	response_s->frame_size = position + 2;
+}
+
+/*
+ * The time of the first request is the entropy: a reset runs the same code in the same cycles, the master polls
+ * on its own clock. The UID keeps devices that were powered up together apart.
+ */
+static uint16_t Get_Delta_Epoch(void)
+{
+	uint32_t seed[2];
+
+	if(delta_epoch == 0)
+	{
+		seed[0] = HAL_GetTick();
+		seed[1] = SysTick->VAL;
+		delta_epoch = Update_CRC16(Calculate_CRC16((uint8_t*)seed, sizeof(seed)), (uint8_t*)UID_BASE, 12);
+		if(delta_epoch == 0)
+		{
+			delta_epoch = 1;
+		}
+	}
+	return delta_epoch;
+}
+
+/*encodes the runs of the whole bank after the response header, returns 1 when they do not fit into one frame*/
+static uint8_t Encode_Changed_Bank(uint8_t bank, uint16_t version, uint32_t max_age, uint16_t *position)
+{
+	uint8_t flg_overflow = 0;
+
+	*position = DELTA_HEADER_SIZE;
+	if(bank == 0)
+	{
+#if SPARSE_REG_MAP
+		for(uint32_t i = 0; i < H_RANGE_COUNT && !flg_overflow; i++)
+		{
+			flg_overflow = Encode_Changed_Runs(RegRanges[i].startAddress, &uint_hold_reg[RegRanges[i].index], &hold_reg_version[RegRanges[i].index],
+					RegRanges[i].count, version, max_age, position);
+		}
+#else
+		flg_overflow = Encode_Changed_Runs(0, uint_hold_reg, hold_reg_version, H_REG_COUNT, version, max_age, position);
+#endif
+	}
+	else
+	{
+		flg_overflow = Encode_Changed_Runs(0, uint_input_reg, input_reg_version, I_REG_COUNT, version, max_age, position);
+	}
+
+	return flg_overflow;
+}
+
+/*appends runs of registers younger than max_age, returns 1 when the frame is full*/
+static uint8_t Encode_Changed_Runs(uint16_t start_address, uint16_t *values, uint16_t *versions, uint16_t count, uint16_t version, uint32_t max_age, uint16_t *position)
+{
+	uint32_t i = 0, run_start, run_length;
+
+	while(i < count)
+	{
+		if((uint16_t)(version - versions[i]) >= max_age)	//not changed
+		{
+			i++;
+			continue;
+		}
+
+		run_start = i;
+		while(i < count && (uint16_t)(version - versions[i]) < max_age && i - run_start < 255)
+		{
+			i++;
+		}
+		run_length = i - run_start;
+
+		if(*position + 3 + 2*run_length > MODBUS_BUFFER_SIZE - 2)
+		{
+			return 1;
+		}
+
+		buf_modbus[(*position)++] = (start_address + run_start)>>8;
+		buf_modbus[(*position)++] = start_address + run_start;
+		buf_modbus[(*position)++] = run_length;
+		for(uint32_t j = run_start; j < run_start + run_length; j++)
+		{
+			buf_modbus[(*position)++] = values[j]>>8;
+			buf_modbus[(*position)++] = values[j];
+		}
+	}
+
+	return 0;
+}
+#endif
+
+#if FIRMWARE_TRANSFER
+/*
+ * FC68 requests:
+ *   start:  [address][0x44][0][image size 4 bytes][CRC]
+ *   data:   [address][0x44][1][block number 2 bytes][flags][up to FW_BLOCK_SIZE bytes][CRC]	flags bit 0 = acknowledge
+ *   status: [address][0x44][2][CRC]
+ *   finish: [address][0x44][3][CRC32 of the image 4 bytes][CRC]
+ * Response: [address][0x44][sub-command][next expected block 2 bytes][CRC]
+ *
+ * Sliding window: the master sends a window of up to FW_WINDOW_BLOCKS data blocks back to back and sets
+ * the acknowledge flag only in the last one. The blocks arriving while flash is erased or programmed wait in the
+ * RX_CIRCULAR_DMA ring; without it the receiver is stopped meanwhile and the window is one block. Blocks are accepted strictly in order, so the answer is a cumulative acknowledgement and
+ * the master resends from the returned block number (go-back-N). Data blocks can be broadcast to update the
+ * whole bus at once, then every device is asked for its status. On finish the CRC32 of the whole image is
+ * checked and the device resets into the bootloader with buff_app_boot[0..7] = FW_STAGED_MARKER,
+ * buff_app_boot[8..11] = image size and buff_app_boot[12..15] = CRC32 (little-endian).
+ */
+static void Firmware_Transfer(struct response_s *response_s)
+{
+	uint16_t crc16, block, data_length;
+	uint32_t value;
+
+	switch(buf_modbus[2])
+	{
+	case fw_start:
+		value = ((uint32_t)buf_modbus[3]<<24) | ((uint32_t)buf_modbus[4]<<16) | (buf_modbus[5]<<8) | buf_modbus[6];
+		if(len_modbus_frame != 9 || value == 0 || value > FW_STAGING_SIZE)
+		{
+			response_s->exception = 0x03;
+			return;
+		}
+		fw_image_size = value;
+		fw_crc32 = 0xFFFFFFFF;
+		ofs_fw_erased = 0;
+		idx_fw_next_block = 0;
+		flg_fw_started = 1;
+		break;
+
+	case fw_data:
+		if(!(buf_modbus[5] & 0x01))	//no acknowledgement inside the window, the master is still sending
+		{
+			response_s->flg_response = 0;
+		}
+		if(!flg_fw_started || len_modbus_frame < 9)
+		{
+			response_s->exception = 0x04;
+			return;
+		}
+		block = (buf_modbus[3]<<8) + buf_modbus[4];
+		data_length = len_modbus_frame - 8;
+		if(block == idx_fw_next_block && (uint32_t)block*FW_BLOCK_SIZE < fw_image_size)	//out of order blocks are dropped
+		{
+			value = fw_image_size - (uint32_t)block*FW_BLOCK_SIZE;	//bytes left in the image
+			if(data_length == ((value < FW_BLOCK_SIZE) ? value : FW_BLOCK_SIZE))
+			{
+				if(Firmware_Store_Block((uint32_t)block*FW_BLOCK_SIZE, &buf_modbus[6], data_length))
+				{
+					response_s->exception = 0x04;	//the master resends from the last acknowledged block
+					return;
+				}
+				fw_crc32 = Update_CRC32(fw_crc32, &buf_modbus[6], data_length);
+				idx_fw_next_block++;
+			}
+		}
+		break;
 
-	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
-	buf_modbus[2] = register_count*2;	// byte count
+	case fw_status:
+		break;
 
-	if(start_address + register_count < 1000)
-	{
-		if(register_count + start_address > H_REG_COUNT)
+	case fw_finish:
+		if(len_modbus_frame != 9)
 		{
-			response_s->exception = 0x02;
+			response_s->exception = 0x03;
+			return;
 		}
-		else
+		value = ((uint32_t)buf_modbus[3]<<24) | ((uint32_t)buf_modbus[4]<<16) | (buf_modbus[5]<<8) | buf_modbus[6];
+		if(!flg_fw_started || (uint32_t)idx_fw_next_block*FW_BLOCK_SIZE < fw_image_size || value != ~fw_crc32)
 		{
-			for(uint32_t i = start_address; i < start_address + register_count; i++)
-			{
-				buf_modbus[3+(i-start_address)*2] = uint_hold_reg[i]>>8;
-				buf_modbus[4+(i-start_address)*2] = uint_hold_reg[i];
-			}
+			response_s->exception = 0x04;
+			return;
 		}
-	}
-	else if (start_address > 998 && start_address < 1010)
-	{
-		if(start_address + register_count > 1010)
+		flg_fw_started = 0;
+		if(response_s->flg_response)
 		{
-			response_s->exception = 0x02;
+			flg_fw_jump = 1;	//after the response is sent
 		}
 		else
 		{
-			for(uint32_t i = start_address; i < start_address + register_count; i++)
-			{
-				buf_modbus[3+(i-start_address)*2] = uint_spec_reg[i-999]>>8;
-				buf_modbus[4+(i-start_address)*2] = uint_spec_reg[i-999];
-			}
+			Firmware_Jump_To_Bootloader();
 		}
-	}
-
-	crc16 = Calculate_CRC16(buf_modbus,3+buf_modbus[2]);
-	buf_modbus[3+buf_modbus[2]] = crc16;	// CRC Lo byte
-	buf_modbus[4+buf_modbus[2]] = crc16>>8;	// CRC Hi byte
-
-	response_s->frame_size = 5 + buf_modbus[2];
+		break;
 
-	if(start_address == 0 && register_count == 4)
-	{
-		response_s->flg_response = 1;
+	default:
+		response_s->exception = 0x03;
+		return;
 	}
+
+	buf_modbus[3] = idx_fw_next_block>>8;
+	buf_modbus[4] = idx_fw_next_block;
+	crc16 = Calculate_CRC16(buf_modbus,5);
+	buf_modbus[5] = crc16;	// CRC Lo byte
+	buf_modbus[6] = crc16>>8;	// CRC Hi byte
+	response_s->frame_size = 7;
 }
 
-static void Write_Multiple_Registers(struct response_s *response_s)
+/*0 = ok, 1 = erase or program failed: ofs_fw_erased stays at the failed page, the block can be sent again*/
+static uint8_t Firmware_Store_Block(uint32_t offset, uint8_t *data, uint16_t len)
 {
-	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t register_count, crc16;
-	uint16_t reg_data;
-	uint16_t uint_hold_reg_temporary[H_REG_COUNT] = {0};
-
-	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
+	uint32_t page_error;
+	uint16_t half_word;
+	HAL_StatusTypeDef status = HAL_OK;
 
-	if(start_address < 1000)
+	HAL_FLASH_Unlock();
+	while(status == HAL_OK && ofs_fw_erased < offset + len)	//pages are erased when the image reaches them
 	{
-		if(register_count + start_address > H_REG_COUNT)
-		{
-			response_s->exception = 0x02;
-		}
-		else if(buf_modbus[6] != len_modbus_frame-9)	//buffer[6] - byte count: 7 bytes - header, 2 bytes - CRC
+		FLASH_EraseInitTypeDef erase = {
+			.TypeErase = FLASH_TYPEERASE_PAGES,
+			.PageAddress = FW_STAGING_ADDRESS + ofs_fw_erased,
+			.NbPages = 1,
+		};
+
+		status = HAL_FLASHEx_Erase(&erase, &page_error);
+		if(status == HAL_OK)
 		{
-			response_s->exception = 0x03;
-		}
-		else
-		{
-			for(uint32_t i = start_address; i < start_address + register_count; i++)
-			{
-				if(RegVirtAddr[i].RW == 0)
-				{
-					reg_data = (buf_modbus[7+(i-start_address)*2]<<8) + buf_modbus[8+(i-start_address)*2];
-
-					if(RegVirtAddr[i].signedUnsigned)	//unsigned
-					{
-						if(((int16_t)RegVirtAddr[i].Minimum <= (int16_t)reg_data)&&((int16_t)reg_data <= (int16_t)RegVirtAddr[i].Maximum))
-						{
-							if(MBR_Check_Restrictions_Callback(i, reg_data))
-							{
-								response_s->exception = 0x03;
-								break;
-							}
-							else
-							{
-								uint_hold_reg_temporary[i] = reg_data;
-							}
-						}
-						else //exceptions when the data is outside of the limits
-						{
-							response_s->exception = 0x03;
-							break;
-						}
-					}
-					else	//signed
-					{
-						if((RegVirtAddr[i].Minimum <= reg_data)&&(reg_data <= RegVirtAddr[i].Maximum))
-						{
-							if(MBR_Check_Restrictions_Callback(i, reg_data))
-							{
-								response_s->exception = 0x03;
-								break;
-							}
-							else
-							{
-								uint_hold_reg_temporary[i] = reg_data;
-							}
-						}
-						else //exceptions when the data is outside of the limits
-						{
-							response_s->exception = 0x03;
-							break;
-						}
-					}
-				}
-			}
-			if(response_s->exception)
-			{
-				//				break;	//from case:
-			}
+			ofs_fw_erased += FLASH_PAGE_SIZE;
 		}
 	}
-
-	for(uint32_t i = start_address; i < start_address + register_count; i++)//write the new data;
+	for(uint32_t i = 0; status == HAL_OK && i < len; i += 2)
 	{
-		if(RegVirtAddr[i].RW == 0)
-		{
-			Update_Data(i, uint_hold_reg_temporary[i]);
-		}
+		half_word = data[i] | ((i+1 < len) ? (data[i+1]<<8) : 0xFF00);	//odd last byte is padded with erased value
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, FW_STAGING_ADDRESS + offset + i, half_word);
 	}
+	HAL_FLASH_Lock();
+	return status != HAL_OK;
+}
 
-	crc16 = Calculate_CRC16(buf_modbus,6);
-	buf_modbus[6] = crc16;								// CRC Lo byte
-	buf_modbus[7] = crc16>>8;							// CRC Hi byte
-	response_s->frame_size = 8;
+static void Firmware_Jump_To_Bootloader(void)
+{
+	uint32_t crc32 = ~fw_crc32;
 
-	if(start_address < 3)
+	for(uint32_t i=0;i<8;i++)
 	{
-		flg_reinit_modbus = 1;
+		buff_app_boot[i] = FW_STAGED_MARKER;
 	}
-	else if((start_address<=8) && (start_address+register_count>8))
+	for(uint32_t i=0;i<4;i++)
 	{
-		if(uint_hold_reg[8]) Set_NBT_Pin();
-		else Reset_NBT_Pin();
+		buff_app_boot[8+i] = fw_image_size>>(8*i);
+		buff_app_boot[12+i] = crc32>>(8*i);
 	}
-	else if((start_address<=9) && (start_address+register_count>9))
+	HAL_NVIC_SystemReset();
+}
+
+/*CRC-32 (IEEE 802.3, reflected), nibble table*/
+static uint32_t Update_CRC32(uint32_t crc, uint8_t *buf, uint16_t len)
+{
+	static const uint32_t crc32_table[16] = {
+			0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+			0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+	while(len--)
 	{
-		Init_Default_Values(seting_values);
+		crc ^= *buf++;
+		crc = (crc>>4) ^ crc32_table[crc & 0x0F];
+		crc = (crc>>4) ^ crc32_table[crc & 0x0F];
 	}
+
+	return crc;
 }
+#endif
 
-static void Write_Single_Register(struct response_s *response_s)
+#if CYCLE_COUNTER
+#if defined(DWT_CTRL_CYCCNTENA_Msk)
+/*DWT cycle counter of Cortex-M3/M4/M7 (enabled in MBR_Init_Modbus()): one read, valid in any interrupt*/
+static uint32_t Get_Cycle_Count(void)
 {
-	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t crc16;
-	uint16_t reg_data;
+	return DWT->CYCCNT;
+}
+#else
+/*
+ * SysTick based cycle counter for cores without DWT (Cortex-M0/M0+), differences stay valid across the 32-bit wrap.
+ * In an interrupt that blocks SysTick_Handler the tick is stale after the reload: the pending SysTick counts it.
+ */
+static uint32_t Get_Cycle_Count(void)
+{
+	uint32_t tick, val, pending;
 
-	reg_data = (buf_modbus[4]<<8)+ buf_modbus[5];
+	do
+	{
+		tick = HAL_GetTick();
+		val = SysTick->VAL;
+		pending = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+	} while(tick != HAL_GetTick() || SysTick->VAL > val);	//SysTick_Handler ran or the counter reloaded during the reads
 
-	if(start_address == 989 && reg_data == 1338)//go to BL
+	if(pending)	//reloaded before val was read, the handler has not run yet
 	{
-		for(uint32_t i=0;i<0x10;i++)
-		{
-			buff_app_boot[i] = 138;
-		}
-		HAL_NVIC_SystemReset();
+		tick++;
 	}
-	else
+	return tick * (SysTick->LOAD + 1) + (SysTick->LOAD - val);
+}
+#endif
+
+static uint8_t Get_Profiled_Handler(uint8_t function_code)
+{
+	switch(function_code)
 	{
-		if(start_address >= H_REG_COUNT)
-		{
-			response_s->exception = 0x02;
-		}
-		if(RegVirtAddr[start_address].RW == 0)//is register writable
-		{
-			if(RegVirtAddr[start_address].signedUnsigned)	//signed
-			{
-				if(((int16_t)RegVirtAddr[start_address].Minimum <= (int16_t)reg_data)&&((int16_t)reg_data <= (int16_t)RegVirtAddr[start_address].Maximum))//is the data in the limits
-				{
-					if(MBR_Check_Restrictions_Callback(start_address, reg_data))
-					{
-						response_s->exception = 0x03;
-					}
-					else
-					{
-						Update_Data(start_address, reg_data);
-					}
-				}
-				else //exceptions when the data is outside of the limits
-				{
-					response_s->exception = 0x03;
-				}
-			}
-			else	//unsigned
-			{
-				if((RegVirtAddr[start_address].Minimum <= reg_data)&&(reg_data <= RegVirtAddr[start_address].Maximum))//is the data in the limits
-				{
-					if(MBR_Check_Restrictions_Callback(start_address, reg_data))
-					{
-						response_s->exception = 0x03;
-					}
-					else
-					{
-						Update_Data(start_address, reg_data);
-					}
-				}
-				else //exceptions when the data is outside of the limits
-				{
-					response_s->exception = 0x03;
-				}
-			}
-		}
+	case read_holding_registers:	return profile_read_holding_registers;
+	case read_input_registers:		return profile_read_input_registers;
+	case write_single_register:		return profile_write_single_register;
+	case write_multiple_registers:	return profile_write_multiple_registers;
+	case 100: case 101: case 102: case 103: case 104: case 105:	return profile_autoassignment;
+	default:						return profile_other;
 	}
+}
+#endif
 
-	buf_modbus[4] = reg_data>>8;	//Register value 1st byte
-	buf_modbus[5] = reg_data;	//Register value 2nd byte
-	crc16 = Calculate_CRC16(buf_modbus,6);
-	buf_modbus[6] = crc16;	//CRC Lo byte
-	buf_modbus[7] = crc16>>8;	//CRC Hi byte
-	response_s->frame_size = 8;
+#if HANDLER_PROFILING
+static void Update_Handler_Stats(uint8_t handler, uint32_t start_cycle)
+{
+	struct structHandlerStats *stats = &handler_stats[handler];
+	uint32_t cycles = Get_Cycle_Count() - start_cycle;
 
-	if(start_address < 3)
+	if(stats->calls == 0)
 	{
-		flg_reinit_modbus = 1;
+		stats->minimum = cycles;
 	}
-	else if(start_address == 8)
+	stats->calls++;
+	stats->last = cycles;
+	stats->total += cycles;
+	if(cycles < stats->minimum) stats->minimum = cycles;
+	if(cycles > stats->maximum) stats->maximum = cycles;
+}
+#endif
+
+#if TRAFFIC_STATISTICS
+/*bucket = 4 * (octave) + two bits below the leading one: 25% steps or better from 4 us up to 131 ms*/
+static void Update_Latency_Histogram(uint32_t cycles)
+{
+	uint32_t us = cycles / (SystemCoreClock / 1000000);
+	uint32_t bucket, msb;
+
+	if(us < 4)
 	{
-		if(uint_hold_reg[8]) Set_NBT_Pin();
-		else Reset_NBT_Pin();
+		bucket = us;
 	}
-	else if(start_address == 9)
+	else
 	{
-		Init_Default_Values(seting_values);
+		msb = 31 - __builtin_clz(us);
+		bucket = 4*(msb-1) + ((us >> (msb-2)) & 0x03);
+	}
+	if(bucket >= LATENCY_BUCKETS)
+	{
+		bucket = LATENCY_BUCKETS - 1;
 	}
-}
 
+	traffic_stats.latency[bucket]++;
+}
+#endif
 
 static void Process_Request(void)
 {
-	struct response_s response_s = {0, 0, 0};
+	struct response_s response_s = {0, 0, 0, buf_modbus};
+#if CYCLE_COUNTER
+	uint8_t function_code = buf_modbus[1];
+#endif
+#if HANDLER_PROFILING
+	uint32_t start_cycle = Get_Cycle_Count();
+#endif
+#if TRAFFIC_STATISTICS
+	traffic_stats.requests++;
+#endif
 
 	if(buf_modbus[0])
 	{
@@ -623,11 +2666,42 @@ static void Process_Request(void)
 		Write_Multiple_Registers(&response_s);
 		break;
 
+#if SCATTER_READ
+	case read_scattered_registers:
+		Read_Scattered_Registers(&response_s);
+		break;
+#endif
+
+#if FIFO_COUNT
+	case read_fifo_queue:
+		Read_FIFO_Queue(&response_s);
+		break;
+#endif
+
+#if BUS_CAPTURE
+	case read_bus_capture:
+		Read_Bus_Capture(&response_s);
+		break;
+#endif
+
+#if DELTA_READ
+	case read_changed_registers:
+		Read_Changed_Registers(&response_s);
+		break;
+#endif
+
+#if FIRMWARE_TRANSFER
+	case firmware_transfer:
+		Firmware_Transfer(&response_s);
+		break;
+#endif
+
 	case 103:	//GO TO AUTOASSIGNMENT MODE
 	case 100:	//SEND RECOGNITION ANSWER
 	case 101:	//CONFIRMATION STEP
 	case 102:	//GET THE NEW ID
 	case 104:	//LEAVE AUTOASSIGNMENT MODE
+	case 105:	//UID SEARCH
 		Process_Autoassignment_Request(&response_s);
 		break;
 
@@ -635,24 +2709,45 @@ static void Process_Request(void)
 		response_s.exception = 0x01;
 	}
 
+#if HANDLER_PROFILING
+	Update_Handler_Stats(Get_Profiled_Handler(function_code), start_cycle);	//response transmission is not included
+#endif
+
 	if(response_s.flg_response)
 	{
+#if TRAFFIC_STATISTICS
+		traffic_stats.responses++;
+		if(response_s.exception)
+		{
+			traffic_stats.exceptions[Get_Profiled_Handler(function_code)]++;
+		}
+		Update_Latency_Histogram(Get_Cycle_Count() - cyc_modbus_frame_end);
+#endif
 		if(response_s.exception)
 		{
 			Send_Exeption(response_s.exception);
 		}
 		else
 		{
-			Send_Response(response_s.frame_size);	// Send packet response
+			Send_Response(response_s.frame, response_s.frame_size);	// Send packet response
 		}
 	}
 }
 
-static void Send_Response(uint8_t count)
+static void Send_Response(uint8_t *frame, uint16_t count)
 {
+#if RX_CIRCULAR_DMA
+	flg_modbus_tx_busy = 1;
+#endif
 	Set_DE_Pin(); //Transmit mode
 	//	HAL_UART_Transmit_IT(modbus_huart, buffer, count);
-	HAL_UART_Transmit_DMA(modbus_huart, buf_modbus, count);
+	if(HAL_UART_Transmit_DMA(modbus_huart, frame, count) != HAL_OK)	//nothing is sent (e.g. count = 0), TxCplt will not come
+	{
+		Reset_DE_Pin();
+#if RX_CIRCULAR_DMA
+		flg_modbus_tx_busy = 0;
+#endif
+	}
 	//	HAL_Delay(1);
 	//	HAL_UART_AbortReceive_IT(modbus_huart);
 	//	HAL_Delay(1);
@@ -669,17 +2764,17 @@ static void Send_Exeption(uint8_t exeption_code)
 	crc16 = Calculate_CRC16(buf_modbus,3);
 	buf_modbus[3] = crc16;	// CRC Lo byte
 	buf_modbus[4] = crc16>>8;	// CRC Hi byte
-	Send_Response(5);	// Send packet response
+	Send_Response(buf_modbus, 5);	// Send packet response
 }
 
 static void Process_Autoassignment_Request(struct response_s *response_s)
 {
-	static uint8_t flg_autoassignment_status, flg_autoassignment_mode;
-
 	uint16_t data;
 
 	uint16_t a, r, crc16;
 
+	flg_autoassignment_delay = 0;	//a new command cancels the recognition answer still waiting
+
 	switch (buf_modbus[1])
 	{
 	case 103:	//GO TO AUTOASSIGNMENT MODE
@@ -687,6 +2782,7 @@ static void Process_Autoassignment_Request(struct response_s *response_s)
 		flg_autoassignment_status = 100;
 		break;
 	case 100:  //SEND RECOGNITION ANSWER
+		response_s->flg_response = 0;	//the answer is delayed, see Send_Autoassignment_Response()
 		if((flg_autoassignment_status == 101)&&(flg_autoassignment_mode == 1))
 		{
 			flg_autoassignment_status = 100;
@@ -695,28 +2791,20 @@ static void Process_Autoassignment_Request(struct response_s *response_s)
 		{
 			if((buf_modbus[2] == 0xAA)&&(buf_modbus[3] == 0xAA)&&(buf_modbus[4] == 0xAA)&&(buf_modbus[5] == 0xAA))
 			{
-				buf_modbus[0] = uint_hold_reg[0];						// Device address
-				buf_modbus[1] = 100;										// Command
-				for(uint32_t i = 0; i < 11; i++)					// unique ID and Production ID
-				{
-					buf_modbus[2+2*i] = uint_spec_reg[i]>>8;
-					buf_modbus[2+2*i+1] = uint_spec_reg[i];
-				}
+				buf_autoassignment[0] = uint_hold_reg[0];				// Device address
+				buf_autoassignment[1] = 100;							// Command
+				Encode_Words(uint_spec_reg, 11, &buf_autoassignment[2]);		// unique ID and Production ID
 				Read_Dummy(3, &a);
-				buf_modbus[24] = a>>8;									// Device type Low byte
-				buf_modbus[25] = a;										// Device type High byte
-				crc16 = Calculate_CRC16(buf_modbus,26);
-				buf_modbus[26] = crc16;									// CRC Low byte
-				buf_modbus[27] = crc16>>8;								// CRC High byte
+				buf_autoassignment[24] = a>>8;							// Device type Low byte
+				buf_autoassignment[25] = a;								// Device type High byte
+				crc16 = Calculate_CRC16(buf_autoassignment,26);
+				buf_autoassignment[26] = crc16;							// CRC Low byte
+				buf_autoassignment[27] = crc16>>8;						// CRC High byte
 
 				//////////////////////// Random Delay generation and scanning ////////////////////////
-				if(Detain_Autoasignment_Response() == 0)//w8 random delay and reply only if this is the first slave replying
-				{
-					//					send_response_via_DMA(buf_modbus, 28);								// Send response packet
-					flg_autoassignment_status = 101;
-					response_s->frame_size = 28;
-
-				}
+				//the main loop keeps running: Send_Autoassignment_Response() replies after the delay if the line stays silent
+				autoassignment_deadline = cnt_modbus_tick + (Calculate_CRC16((uint8_t*)UID_BASE, 12) & 0x3FF);
+				flg_autoassignment_delay = 1;
 			}
 		}
 		break;
@@ -725,13 +2813,9 @@ static void Process_Autoassignment_Request(struct response_s *response_s)
 		if((flg_autoassignment_status == 101)&&(flg_autoassignment_mode == 1))//is this controller in this mode?
 		{
 			///////////Compare the  unique ID and Production ID
-			uint16_t Special_registers_compare[11];
 			for(uint32_t i = 0; i < 11; i++)
 			{
-				Special_registers_compare[i] = buf_modbus[7+2*i];
-				Special_registers_compare[i] <<= 8;
-				Special_registers_compare[i] += buf_modbus[7+2*i+1];
-				if(uint_spec_reg[i] != Special_registers_compare[i])
+				if(uint_spec_reg[i] != (buf_modbus[7+2*i]<<8) + buf_modbus[7+2*i+1])
 				{
 					flg_autoassignment_status = 100;
 				}
@@ -752,11 +2836,7 @@ static void Process_Autoassignment_Request(struct response_s *response_s)
 			{
 				buf_modbus[0] = uint_hold_reg[0];						// Device address
 				buf_modbus[1] = 101;										// Command
-				for(uint32_t i = 0; i < 11; i++)// 							unique ID and Production ID
-				{
-					buf_modbus[2+2*i] = uint_spec_reg[i]>>8;
-					buf_modbus[2+2*i+1] = uint_spec_reg[i];
-				}
+				Encode_Words(uint_spec_reg, 11, &buf_modbus[2]);				// unique ID and Production ID
 
 				Read_Dummy(3, &data);
 				a = data;
@@ -776,14 +2856,10 @@ static void Process_Autoassignment_Request(struct response_s *response_s)
 		if((flg_autoassignment_status == 102)&&(flg_autoassignment_mode == 1))	//is this controller in this mode?
 		{
 			///////////Compare the  unique ID and Production ID
-			uint16_t Special_registers_compare[11];
 			uint8_t flg_another_controller_addressed = 0;
 			for(uint32_t i = 0; i < 11; i++)
 			{
-				Special_registers_compare[i] = buf_modbus[9+2*i];
-				Special_registers_compare[i] <<= 8;
-				Special_registers_compare[i] += buf_modbus[9+2*i+1];
-				if(uint_spec_reg[i] != Special_registers_compare[i])
+				if(uint_spec_reg[i] != (buf_modbus[9+2*i]<<8) + buf_modbus[9+2*i+1])
 				{
 					flg_another_controller_addressed = 1;
 				}
@@ -822,6 +2898,35 @@ static void Process_Autoassignment_Request(struct response_s *response_s)
 		response_s->frame_size = 0;
 		break;
 
+	case 105:	//UID SEARCH: [address][105][prefix length in bits][UID 12 bytes][CRC]
+		/*
+		 * Deterministic alternative to the random delay of command 100: every unassigned device whose UID starts
+		 * with the given prefix replies at once. The master walks the UID tree: no reply = no device below this
+		 * prefix, a corrupted reply = several devices (extend the prefix by one bit), a clean reply = probably one
+		 * device. A collision can still look clean when one transmitter overrides the others, so the master confirms
+		 * the UID with command 101 (only the device with exactly this UID answers, the others go back to waiting)
+		 * and assigns the address with 102, then searches the same prefix again. All devices are found in
+		 * O(n*log(UID)) exchanges, port/linux/mbr_enum_sim simulates it.
+		 */
+		if((flg_autoassignment_mode == 1)&&((flg_autoassignment_status == 100)||(flg_autoassignment_status == 101)))
+		{
+			if((buf_modbus[2] <= 96)&&(Match_UID_Prefix(&buf_modbus[3], buf_modbus[2])))
+			{
+				buf_modbus[0] = uint_hold_reg[0];						// Device address
+				buf_modbus[1] = 105;									// Command
+				Encode_Words(uint_spec_reg, 11, &buf_modbus[2]);				// unique ID and Production ID
+				Read_Dummy(3, &a);
+				buf_modbus[24] = a>>8;									// Device type Low byte
+				buf_modbus[25] = a;										// Device type High byte
+				crc16 = Calculate_CRC16(buf_modbus,26);
+				buf_modbus[26] = crc16;									// CRC Low byte
+				buf_modbus[27] = crc16>>8;								// CRC High byte
+				flg_autoassignment_status = 101;						// ready for the confirmation step
+				response_s->frame_size = 28;
+			}
+		}
+		break;
+
 	default:
 		response_s->frame_size = 0;
 	}
@@ -862,6 +2967,8 @@ static void Init_Default_Values(uint8_t values)
 
 static void Update_Communication_Parameters(void)
 {
+	uint16_t rto_bits = 0;	//receiver timeout in bits: t3.5, 1.75 ms above 19200 baud
+
 	/*parity*/
 	switch (uint_hold_reg[2]) {
 	case 0:
@@ -881,48 +2988,71 @@ static void Update_Communication_Parameters(void)
 	switch (uint_hold_reg[1]) {
 	case 0:
 		modbus_huart->Init.BaudRate = 4800;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 39);
+		rto_bits = 39;
 		break;
 	case 1:
 		modbus_huart->Init.BaudRate = 9600;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 39);
+		rto_bits = 39;
 		break;
 	case 2:
 		modbus_huart->Init.BaudRate = 19200;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 39);
+		rto_bits = 39;
 		break;
 	case 3:
 		modbus_huart->Init.BaudRate = 38400;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 67);
+		rto_bits = 67;
 		break;
 	case 4:
 		modbus_huart->Init.BaudRate = 57600;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 101);
+		rto_bits = 101;
 		break;
 	case 5:
 		modbus_huart->Init.BaudRate = 115200;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 202);
+		rto_bits = 202;
 		break;
 	case 6:
 		modbus_huart->Init.BaudRate = 230400;
-		HAL_UART_ReceiverTimeout_Config(modbus_huart, 403);
+		rto_bits = 403;
 		break;
 	} //default is 19200
 
+	if(rto_bits)
+	{
+#if IDLE_LINE_FRAMING
+		uint16_t char_bits = (modbus_huart->Init.Parity == UART_PARITY_NONE) ? 10 : 11;	//the idle line flag comes one character after the last byte
+		__HAL_TIM_SET_AUTORELOAD(frame_htim, (uint32_t)(rto_bits - char_bits) * 1000000 / modbus_huart->Init.BaudRate);
+#else
+		HAL_UART_ReceiverTimeout_Config(modbus_huart, rto_bits);
+#endif
+	}
+
 	modbus_huart->Instance = USART1;
 	modbus_huart->Init.StopBits = UART_STOPBITS_1;
 	modbus_huart->Init.Mode = UART_MODE_TX_RX;
 	modbus_huart->Init.HwFlowCtl = UART_HWCONTROL_NONE;
 	modbus_huart->Init.OverSampling = UART_OVERSAMPLING_16;
+#if DE_MODE
+	HAL_RS485Ex_Init(modbus_huart, UART_DE_POLARITY_HIGH, DE_ASSERTION_TIME, DE_DEASSERTION_TIME);	//times are in sample units: 1/16 bit
+#else
 	HAL_UART_Init(modbus_huart);
+#endif
+#if IDLE_LINE_FRAMING
+	__HAL_UART_ENABLE_IT(modbus_huart, UART_IT_IDLE);
+#endif
 }
 
 
 static void Init_USART_DMA(void)
 {
+#if !IDLE_LINE_FRAMING	//the idle line interrupt is enabled in Update_Communication_Parameters()
 	HAL_UART_ReceiverTimeout_Config(modbus_huart, 34);
 	HAL_UART_EnableReceiverTimeout(modbus_huart);
-	HAL_UART_Receive_DMA(modbus_huart, buf_modbus, 0x100);
+#endif
+#if RX_CIRCULAR_DMA
+	HAL_UART_Receive_DMA(modbus_huart, buf_modbus_rx, RX_RING_SIZE);
+#else
+	HAL_UART_Receive_DMA(modbus_huart, buf_modbus, MODBUS_BUFFER_SIZE);
+#endif
 }
 
 static void Check_Modbus_Registers(void)	//UPDATED
@@ -931,6 +3061,12 @@ static void Check_Modbus_Registers(void)	//UPDATED
 
 	for(uint32_t i=0;i<H_REG_COUNT;i++)	//from the first to the last register
 	{
+#if W_REG_COUNT
+		if(Find_Wide_Register(i))	//32-bit values are checked as a whole below
+		{
+			continue;
+		}
+#endif
 		if(RegVirtAddr[i].RW == 0 && RegVirtAddr[i].virtualAddress != 0)
 		{
 			Read_Dummy(i, &reg_data);
@@ -951,6 +3087,21 @@ static void Check_Modbus_Registers(void)	//UPDATED
 			}
 		}
 	}
+
+#if W_REG_COUNT
+	uint16_t second_word;
+
+	for(uint32_t i=0;i<W_REG_COUNT;i++)
+	{
+		Read_Dummy(RegWide[i].index, &reg_data);
+		Read_Dummy(RegWide[i].index+1, &second_word);
+
+		if(Check_Wide_Value(&RegWide[i], reg_data, second_word))
+		{
+			Update_Wide_Data(&RegWide[i], RegVirtAddr[RegWide[i].index].DefaultValue, RegVirtAddr[RegWide[i].index+1].DefaultValue);	//Not OK = write default value of both words
+		}
+	}
+#endif
 }
 
 static void Check_HW_FW_Version(void)
@@ -978,13 +3129,31 @@ static void Check_HW_FW_Version(void)
 }
 
 
+static void Run_Scheduled_Jobs(void)
+{
+	uint32_t now = cnt_modbus_tick;
+
+	for(uint32_t i = 0; i < sizeof(modbus_jobs)/sizeof(modbus_jobs[0]); i++)
+	{
+		if((int32_t)(now - modbus_jobs[i].next_run) >= 0)
+		{
+			modbus_jobs[i].next_run += modbus_jobs[i].period;
+			if((int32_t)(now - modbus_jobs[i].next_run) >= 0)	//main loop was blocked for more than one period: do not catch up
+			{
+				modbus_jobs[i].next_run = now + modbus_jobs[i].period;
+			}
+			modbus_jobs[i].job();
+		}
+	}
+}
+
 static void Check_Communication_Reset_Jumper(void)
 {
 	static uint8_t cnt_reset_communication_pressed, flg_reset_communication_completed;
 
 	if(HAL_GPIO_ReadPin(GPIOA, GPIO_PIN_14))
 	{
-		if(!flg_reset_communication_completed && (cnt_reset_communication_pressed == 50))
+		if(!flg_reset_communication_completed && (cnt_reset_communication_pressed == 5))
 		{
 			Init_Default_Values(communication_values);
 			flg_reset_communication_completed = 1;
@@ -1005,7 +3174,7 @@ static void Check_Modbus_Timeout(void)
 	{
 		if(flg_modbus_no_comm == 0)
 		{
-			if(cnt_modbus_no_comm < (uint_hold_reg[7] * 60))
+			if(cnt_modbus_no_comm < uint_hold_reg[7])
 			{
 				cnt_modbus_no_comm++;
 			}
@@ -1017,42 +3186,126 @@ static void Check_Modbus_Timeout(void)
 	}
 }
 
-static uint8_t Detain_Autoasignment_Response(void)
+/*UID bytes in the order of uint_spec_reg[0..5], most significant bit first*/
+static uint8_t Match_UID_Prefix(uint8_t *prefix, uint8_t bit_count)
 {
-	uint16_t device_unique_value;
-
-	device_unique_value = Calculate_CRC16((uint8_t*)UID_BASE, 12);
-
-	cnt_autoassignment_delay =  device_unique_value & 0x3FF;	//XXX test it
+	uint8_t uid_byte;
 
-	while(cnt_autoassignment_delay)	//scanning
+	for(uint32_t i = 0; i < bit_count; i++)
 	{
-		//check UART RX pin
-		if((USART1_RX_GPIO_Port->IDR&USART1_RX_Pin) == 0)	//XXX test it
+		uid_byte = (i%16 < 8) ? (uint_spec_reg[i/16]>>8) : uint_spec_reg[i/16];
+		if(((uid_byte ^ prefix[i/8]) << (i%8)) & 0x80)
 		{
-			return 1;
+			return 0;
 		}
 	}
-	return 0;
+	return 1;
+}
+
+/*recognition answer of command 100 after a delay of CRC16(UID) & 0x3FF ms, dropped if another device starts first*/
+static void Send_Autoassignment_Response(void)
+{
+	uint16_t cnt_dma;
+
+	if(flg_autoassignment_delay == 0)
+	{
+		return;
+	}
+
+	cnt_dma = modbus_huart->hdmarx->Instance->CNDTR;
+	if(flg_autoassignment_delay == 1)	//first run after the request, the receiver is restarted by now
+	{
+		cnt_autoassignment_dma = cnt_dma;
+		flg_autoassignment_delay = 2;
+	}
+#if RX_CIRCULAR_DMA
+	if((cnt_dma != cnt_autoassignment_dma) || (idx_rx_queue_tail != idx_rx_queue_head)
+#else
+	if((cnt_dma != cnt_autoassignment_dma) || flg_modbus_packet_received
+#endif
+			|| ((USART1_RX_GPIO_Port->IDR&USART1_RX_Pin) == 0))	//another device is replying: wait for the next command 100
+	{
+		flg_autoassignment_delay = 0;
+		return;
+	}
+
+	if((int32_t)(cnt_modbus_tick - autoassignment_deadline) >= 0)
+	{
+		flg_autoassignment_delay = 0;
+		flg_autoassignment_status = 101;
+		Send_Response(buf_autoassignment, sizeof(buf_autoassignment));
+	}
 }
 
 static void Update_Data(uint16_t register_number, uint16_t reg_data)
 {
 	Write_Dummy(RegVirtAddr[register_number].virtualAddress, reg_data);
 	uint_hold_reg[register_number] = reg_data;
+#if DELTA_READ || RESPONSE_CACHE
+	Advance_Version(&hold_version);
+#endif
+#if DELTA_READ
+	hold_reg_version[register_number] = hold_version;
+#endif
 	MBR_Register_Update_Callback(register_number, reg_data);
 }
 
+#if W_REG_COUNT
+/*both words are in uint_hold_reg[] before the first callback and are stored together: nobody sees a torn value*/
+static void Update_Wide_Data(const struct structHRWide *wide, uint16_t first_word, uint16_t second_word)
+{
+	uint16_t index = wide->index;
+
+	uint_hold_reg[index] = first_word;
+	uint_hold_reg[index+1] = second_word;
+	if(Write_Pair_Dummy)
+	{
+		Write_Pair_Dummy(RegVirtAddr[index].virtualAddress, first_word, RegVirtAddr[index+1].virtualAddress, second_word);
+	}
+	else
+	{
+		Write_Dummy(RegVirtAddr[index].virtualAddress, first_word);
+		Write_Dummy(RegVirtAddr[index+1].virtualAddress, second_word);
+	}
+#if DELTA_READ || RESPONSE_CACHE
+	Advance_Version(&hold_version);
+#endif
+#if DELTA_READ
+	hold_reg_version[index] = hold_version;
+	hold_reg_version[index+1] = hold_version;
+#endif
+	MBR_Register_Update_Callback(index, first_word);
+	MBR_Register_Update_Callback(index+1, second_word);
+}
+#endif
+
+#if DELTA_READ || RESPONSE_CACHE
+static void Advance_Version(uint16_t *version)
+{
+	(*version)++;
+#if RESPONSE_CACHE
+	if(*version == 0)	//after the wrap around an old cached response would look current again
+	{
+		MBR_Invalidate_Cache();
+	}
+#endif
+}
+#endif
+
 
 static void Set_DE_Pin(void)
 {
+#if !DE_MODE	//the USART drives DE itself
 	USART1_DE_GPIO_Port->BSRR = USART1_DE_Pin;
+#endif
 	MBR_Switch_DE_Callback(1);
 }
 
 static void Reset_DE_Pin(void)
 {
+#if !DE_MODE
 	USART1_DE_GPIO_Port->BRR = USART1_DE_Pin;
+#endif
 	MBR_Switch_DE_Callback(0);
 }
 
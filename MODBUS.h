@@ -3,47 +3,294 @@
 
 #include "main.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*DEFINE NUMBER OF REGISTERS*/
+#ifndef I_REG_COUNT
 #define I_REG_COUNT				10	//number of the input registers
+#endif
+#ifndef H_REG_COUNT
 #define H_REG_COUNT				60	//number of the holding registers
+#endif
+#ifndef H_REG_HIDDEN
 #define H_REG_HIDDEN			10	//number of last holding registers that cannot be overwritten with default value (for calibration and etc.)
+#endif
+#ifndef S_REG_COUNT
 #define S_REG_COUNT				11	//number of the special registers (the first 11 are used to keep UID and PID)
+#endif
+#ifndef H_RANGE_COUNT
+#define H_RANGE_COUNT			1	//number of runs in RegRanges[] (SPARSE_REG_MAP only)
+#endif
+#ifndef W_REG_COUNT
+#define W_REG_COUNT				0	//number of 32-bit values in RegWide[], each one occupies two holding registers (0 = RegWide[] is not used)
+#endif
 
-/*MODBUS LIBRARY SETTINGS*/
+/*MODBUS LIBRARY SETTINGS (every setting can also be given on the compiler command line, e.g. -DTRAFFIC_STATISTICS=1)*/
+#ifndef FRAME_BUFFER_SIZE
+#define FRAME_BUFFER_SIZE			256		//request/response buffer (64-256 bytes), a smaller one limits FC03/FC04/FC67 to (size-5)/2 and FC16 to (size-9)/2 registers
+#endif
+#ifndef COMPACT_CRC_TABLE
+#define COMPACT_CRC_TABLE			0		//CRC16 with a 16-entry table: 32 instead of 512 bytes of flash, about two times slower: 0=OFF, 1=ON
+#endif
+#ifndef COMPACT_REG_MAP
+#define COMPACT_REG_MAP				0		//RW and signedUnsigned of RegVirtAddr[] share one byte: 8 instead of 10 bytes per register without SPARSE_REG_MAP: 0=OFF, 1=ON
+#endif
+#ifndef COMPILED_REG_MAP
+#define COMPILED_REG_MAP			0		//writable mask and limit checks of the write handlers generated from MBR_REGISTER_MAP of MODBUS.hpp (C++17): 0=OFF, 1=ON
+#endif
+#ifndef UPDATE_HW_VERSION
 #define UPDATE_HW_VERSION			0		//update HW version after default values of HR4-HR6 were changed: 0=OFF, 1=ON
+#endif
+#ifndef DE_MODE
+#define DE_MODE						0		//RS-485 driver enable: 0=DE GPIO switched in software, 1=USART DE output (configure the DE pin as USART alternate function)
+#endif
+#ifndef DE_ASSERTION_TIME
+#define DE_ASSERTION_TIME			8		//DE_MODE=1: time between DE rise and the start bit, in 1/16 bit (0-31)
+#endif
+#ifndef DE_DEASSERTION_TIME
+#define DE_DEASSERTION_TIME			8		//DE_MODE=1: time between the end of the last stop bit and DE fall, in 1/16 bit (0-31)
+#endif
+#ifndef RX_CIRCULAR_DMA
+#define RX_CIRCULAR_DMA				0		//receive into a DMA ring that is never stopped (DMA channel in circular mode, call MBR_UART_IRQ_Handler()): 0=OFF, 1=ON
+#endif
+#ifndef RX_RING_SIZE
+#define RX_RING_SIZE				512		//RX_CIRCULAR_DMA=1: size of the receive ring in bytes
+#endif
+#ifndef RX_QUEUE_SIZE
+#define RX_QUEUE_SIZE				4		//RX_CIRCULAR_DMA=1: received frames waiting for MBR_Check_For_Request()
+#endif
+#ifndef IDLE_LINE_FRAMING
+#define IDLE_LINE_FRAMING			0		//frame end from the idle line interrupt and a 1 us timer instead of the receiver timeout (USART without RTO, call MBR_UART_IRQ_Handler() and MBR_Timer_Callback()): 0=OFF, 1=ON
+#endif
+#ifndef BUS_CAPTURE
+#define BUS_CAPTURE					0		//copy every received frame (any slave, any CRC) into the capture ring, drained with FC65: 0=OFF, 1=ON
+#endif
+#ifndef CAPTURE_BUFFER_SIZE
+#define CAPTURE_BUFFER_SIZE			1024	//size of the capture ring in bytes
+#endif
+#ifndef CAPTURE_SNAP_LENGTH
+#define CAPTURE_SNAP_LENGTH			64		//max number of frame bytes kept per record (max 242)
+#endif
+#ifndef SPARSE_REG_MAP
+#define SPARSE_REG_MAP				0		//place holding registers anywhere in the 16-bit address space with RegRanges[]: 0=OFF (address = index), 1=ON
+#endif
+#ifndef PERSISTENT_JOURNAL
+#define PERSISTENT_JOURNAL			0		//built-in flash journal, pass MBR_Journal_Read/MBR_Journal_Write to MBR_Init_Modbus(): 0=OFF, 1=ON
+#endif
+#ifndef JOURNAL_BASE_ADDRESS
+#define JOURNAL_BASE_ADDRESS		0x0800F000	//address of the first flash page of the journal
+#endif
+#ifndef JOURNAL_PAGE_COUNT
+#define JOURNAL_PAGE_COUNT			2		//number of flash pages used round robin (min 2)
+#endif
+#ifndef JOURNAL_PROGRAM_STEP
+#define JOURNAL_PROGRAM_STEP		16		//changed registers programmed per MBR_Journal_Flush() call, MBR_Journal_Write() never waits for flash
+#endif
+#ifndef JOURNAL_COPY_STEP
+#define JOURNAL_COPY_STEP			8		//records copied per MBR_Journal_Flush() call during compaction
+#endif
+#ifndef JOURNAL_FLUSH_PERIOD
+#define JOURNAL_FLUSH_PERIOD		100		//ms between MBR_Journal_Flush() calls made by the library
+#endif
+#ifndef FIRMWARE_TRANSFER
+#define FIRMWARE_TRANSFER			0		//in-application firmware transfer into the staging area with FC68: 0=OFF, 1=ON
+#endif
+#ifndef FW_STAGING_ADDRESS
+#define FW_STAGING_ADDRESS			0x08010000	//flash address of the staging area (page aligned)
+#endif
+#ifndef FW_STAGING_SIZE
+#define FW_STAGING_SIZE				0x8000	//size of the staging area in bytes
+#endif
+#ifndef FW_WINDOW_BLOCKS
+#define FW_WINDOW_BLOCKS			1		//FC68 data blocks the master may send before it waits for the acknowledgement, more than 1 needs RX_CIRCULAR_DMA=1
+#endif
+#ifndef FIFO_COUNT
+#define FIFO_COUNT					0		//number of FIFOs read with FC24 Read FIFO Queue and filled with MBR_FIFO_Push() (0 = FC24 is not supported)
+#endif
+#ifndef FIFO_SIZE
+#define FIFO_SIZE					64		//values per FIFO (power of two)
+#endif
+#ifndef FIFO_ADDRESS
+#define FIFO_ADDRESS				2000	//FC24 pointer address of FIFO 0, FIFO n is at FIFO_ADDRESS+n
+#endif
+#ifndef SCATTER_READ
+#define SCATTER_READ				0		//read up to 16 ranges of holding and input registers in one request with FC67: 0=OFF, 1=ON
+#endif
+#ifndef DELTA_READ
+#define DELTA_READ					0		//read only the registers changed since a given version with FC66: 0=OFF, 1=ON
+#endif
+#ifndef RESPONSE_CACHE
+#define RESPONSE_CACHE				0		//number of FC03/FC04 responses kept encoded with the CRC and sent again while the registers are unchanged (0 = OFF)
+#endif
+#ifndef RESPONSE_CACHE_REGISTERS
+#define RESPONSE_CACHE_REGISTERS	16		//RESPONSE_CACHE>0: longer responses are not cached
+#endif
+#ifndef HANDLER_PROFILING
+#define HANDLER_PROFILING			0		//measure every request handler in core clock cycles, read with MBR_Get_Handler_Stats(): 0=OFF, 1=ON
+#endif
+#ifndef TRAFFIC_STATISTICS
+#define TRAFFIC_STATISTICS			0		//count frames, errors, exceptions and turnaround latency, read with MBR_Get_Traffic_Stats(): 0=OFF, 1=ON
+#endif
+
+/*HANDLER PROFILING*/
+enum profiled_handler_e
+{
+	profile_read_holding_registers = 0,
+	profile_read_input_registers,
+	profile_write_single_register,
+	profile_write_multiple_registers,
+	profile_autoassignment,
+	profile_check_modbus_registers,
+	profile_other,	//vendor function codes and unsupported requests
+	profile_count
+};
+
+struct structHandlerStats	//all times are in core clock cycles, measured with DWT->CYCCNT (SysTick on Cortex-M0/M0+)
+{
+	uint32_t calls;
+	uint32_t last;
+	uint32_t minimum;
+	uint32_t maximum;
+	uint32_t total;	//wraps around, use together with calls for average
+};
+
+/*TRAFFIC STATISTICS*/
+#define LATENCY_BUCKETS			64	//turnaround histogram: 4 buckets per octave of microseconds, the last one also keeps everything above
+
+struct structTrafficStats
+{
+	uint32_t frames;	//frames seen at the end of reception
+	uint32_t crc_errors;	//RX_CIRCULAR_DMA=1: only frames addressed to this device are checked
+	uint32_t uart_errors;	//framing, noise, parity and overrun errors
+	uint32_t dropped;	//RX_CIRCULAR_DMA=1: frames lost because the queue was full
+	uint32_t requests;	//valid requests processed (broadcast included)
+	uint32_t responses;
+	uint32_t exceptions[profile_count];	//exception responses by profiled_handler_e
+	uint32_t latency[LATENCY_BUCKETS];	//end of the request frame to the start of the response transmission
+};
+
+/*32-BIT REGISTERS*/
+enum wide_type_e
+{
+	wide_u32 = 0,
+	wide_i32,
+	wide_f32
+};
+
+enum wide_word_order_e
+{
+	wide_high_word_first = 0,	//Modbus convention: the first register keeps bits 31..16
+	wide_low_word_first
+};
+
+union unionWide
+{
+	uint32_t u32;
+	int32_t i32;
+	float f32;
+};
+
+struct structHRWide
+{
+	uint16_t index;	//index of the first of two holding registers in uint_hold_reg[]
+	uint8_t type;	//wide_type_e
+	uint8_t wordOrder;	//wide_word_order_e
+	union unionWide Minimum;
+	union unionWide Maximum;
+};
 
 /*FUNCTIONS THAT CAN BE USED IN OTHER MODULES*/
+#define MBR_FIRST_START_PROBE	0xA001	//MBR_Init_Modbus() reads it first: the read handler returns 1 when nothing is stored yet (the first start), later reads use register numbers
 void MBR_Init_Modbus(UART_HandleTypeDef *huart, void *read_handler, void *write_handler);	//call this function in main.c after initialisation of all hardware
-void MBR_Check_For_Request(void);
+void MBR_Check_For_Request(void);	//call this function in the main loop, it also runs the library housekeeping jobs
 void MBR_Rewrite_Register(uint16_t register_number, uint16_t reg_data);	//call this function to overwrite HR value in uint_hold_reg[] and EEPROM
-void MBR_Inc_Tick(void);	//call this function inside SysTick_Handler
-void MBR_Switch_DE_Callback(uint8_t state);	//weak ref, can be defined in other modules. state variants: 0=reset_DERE, 1=set_DERE
+void MBR_Publish_Input_Register(uint16_t register_number, uint16_t reg_data);	//call this function to update uint_input_reg[] (keeps FC66 change tracking up to date)
+#if RESPONSE_CACHE
+void MBR_Invalidate_Cache(void);	//call this function after writing uint_input_reg[] or uint_hold_reg[] directly, the cached FC03/FC04 responses are encoded again
+#endif
+#if FIFO_COUNT
+uint8_t MBR_FIFO_Push(uint8_t fifo_number, uint16_t value);	//can be called in an interrupt (one producer per FIFO), return 0 when OK, return 1 when the FIFO is full
+#endif
+#if RX_CIRCULAR_DMA || IDLE_LINE_FRAMING
+void MBR_UART_IRQ_Handler(void);	//call this function at the beginning of USARTx_IRQHandler, before HAL_UART_IRQHandler()
+#endif
+#if IDLE_LINE_FRAMING
+void MBR_Init_Frame_Timer(TIM_HandleTypeDef *htim);	//call this function before MBR_Init_Modbus(), the timer must count microseconds and have the update interrupt enabled
+void MBR_Timer_Callback(TIM_HandleTypeDef *htim);	//call this function in HAL_TIM_PeriodElapsedCallback()
+#endif
+void MBR_Inc_Tick(void);	//call this function inside SysTick_Handler, it only counts milliseconds
+#if W_REG_COUNT
+void MBR_Rewrite_Wide_Register(uint16_t wide_number, union unionWide value);	//overwrite both words of RegWide[wide_number] in uint_hold_reg[] and EEPROM
+union unionWide MBR_Get_Wide_Register(uint16_t wide_number);
+void MBR_Init_Wide_Write(void *write_pair_handler);	//call this function before MBR_Init_Modbus(): the handler stores both words of a 32-bit value in one step (no torn value after a reset)
+#endif
+void MBR_Switch_DE_Callback(uint8_t state);	//weak ref, can be defined in other modules. state variants: 0=reset_DERE, 1=set_DERE (called in both DE modes)
 uint8_t MBR_Check_Restrictions_Callback(uint16_t register_address, uint16_t register_data);	//weak ref, can be defined in other modules. return 0 when OK, return 1 when NOK
 void MBR_Register_Update_Callback(uint16_t register_address, uint16_t register_data);
+#if PERSISTENT_JOURNAL
+uint8_t MBR_Journal_Read(uint16_t register_number, uint16_t *data);	//read handler for MBR_Init_Modbus(), register number or MBR_FIRST_START_PROBE: 0 = ok, 1 = no value stored
+uint8_t MBR_Journal_Read_Address(uint16_t address, uint16_t *data);	//read by the virtual address from RegVirtAddr[]: 0 = ok, 1 = no value stored
+uint8_t MBR_Journal_Write(uint16_t address, uint16_t data);	//write handler for MBR_Init_Modbus(): 0 = ok, 1 = unknown register
+#if W_REG_COUNT
+uint8_t MBR_Journal_Write_Pair(uint16_t first_address, uint16_t first_data, uint16_t second_address, uint16_t second_data);	//pair handler for MBR_Init_Wide_Write(): 0 = ok, 1 = unknown registers
+#endif
+void MBR_Journal_Flush(void);	//programs pending records and runs compaction, called every JOURNAL_FLUSH_PERIOD ms from MBR_Check_For_Request()
+#endif
+#if HANDLER_PROFILING
+const struct structHandlerStats *MBR_Get_Handler_Stats(uint8_t handler);	//handler is one of the profiled_handler_e values
+void MBR_Reset_Handler_Stats(void);
+#endif
+#if TRAFFIC_STATISTICS
+const struct structTrafficStats *MBR_Get_Traffic_Stats(void);
+uint32_t MBR_Get_Latency_Percentile(uint16_t permille);	//turnaround in us (upper bound of the histogram bucket), e.g. 500=p50, 990=p99, 999=p99.9
+void MBR_Reset_Traffic_Stats(void);
+#endif
 
 
 /*BUFFERS AND FLAGS THAT CAN BE USED IN OTHER MODULES [READ-ONLY]*/
 /*buffers*/
-extern uint16_t uint_input_reg[I_REG_COUNT];	//input registers	//TODO union signed/unsigned
-extern uint16_t uint_hold_reg[H_REG_COUNT];	//holding registers
+extern uint16_t uint_input_reg[I_REG_COUNT];	//input registers, write them with MBR_Publish_Input_Register() (RESPONSE_CACHE: a direct write needs MBR_Invalidate_Cache())	//TODO union signed/unsigned
+extern uint16_t uint_hold_reg[H_REG_COUNT];	//holding registers, write them with MBR_Rewrite_Register() (RESPONSE_CACHE: a direct write needs MBR_Invalidate_Cache())
 extern uint16_t uint_spec_reg[S_REG_COUNT];	//special registers
 /*flags*/
-extern uint8_t flg_modbus_no_comm;	//raises after uint_hold_reg[7] seconds
+extern uint8_t flg_modbus_no_comm;	//raises after uint_hold_reg[7] seconds without valid requests
 extern uint8_t flg_modbus_packet_received;
 
 
 
 
+#if SPARSE_REG_MAP
+typedef uint16_t virt_addr_t;
+#else
+typedef uint8_t virt_addr_t;
+#endif
+
 struct structHRVA
 {
-	uint8_t virtualAddress;
+	virt_addr_t virtualAddress;
+#if COMPACT_REG_MAP
+	uint8_t RW:2;
+	uint8_t signedUnsigned:1;
+#else
 	uint8_t RW;
 	uint8_t signedUnsigned;
+#endif
 	uint16_t Minimum;
 	uint16_t Maximum;
 	uint16_t DefaultValue;
 };
 
+/*generated by MBR_REGISTER_MAP of MODBUS.hpp (COMPILED_REG_MAP=1) instead of reading RW, signedUnsigned, Minimum and Maximum
+  of RegVirtAddr[] in every write*/
+struct structRegChecks
+{
+	uint32_t writable[(H_REG_COUNT + 31) / 32];	//bit i: uint_hold_reg[i] can be written by the master
+	uint32_t ranged[(H_REG_COUNT + 31) / 32];	//bit i: the value of uint_hold_reg[i] has to be checked against its limits
+	uint8_t (*check_value[H_REG_COUNT])(uint16_t reg_data);	//limits of uint_hold_reg[i] as immediate values: 0 = ok, 0x03 = outside
+};
+
 /*example of definition of holding registers*/
 //const struct structHRVA RegVirtAddr[H_REG_COUNT] =		// 0-RW, 1-RO, 2-NA
 //{//		addr	r/w		sgn 	min 	max 	def
@@ -59,4 +306,34 @@ struct structHRVA
 //	{0xA00A,	0,		0,		0,		1,		0		},	//10	Modbus reset
 //};
 
+/*example of definition of 32-bit registers (W_REG_COUNT=2), both words must be RW registers, their own min/max in RegVirtAddr[] are not used,
+  FC06 to either word is rejected, FC16 has to write both words in one request. Both words are stored in one step by the handler
+  passed to MBR_Init_Wide_Write() (MBR_Journal_Write_Pair with PERSISTENT_JOURNAL), otherwise a reset between the two writes can tear the value*/
+//const struct structHRWide RegWide[W_REG_COUNT] =
+//{//		index	type		word order				min					max
+//	{20,		wide_u32,	wide_high_word_first,	{.u32 = 0},			{.u32 = 4000000000}	},	//21-22		Energy counter preset
+//	{22,		wide_f32,	wide_high_word_first,	{.f32 = -10.0f},	{.f32 = 150.5f}		},	//23-24		Flow setpoint
+//};
+
+/*run of contiguous holding registers: Modbus addresses startAddress..startAddress+count-1 are uint_hold_reg[index..index+count-1]*/
+struct structHRRange
+{
+	uint16_t startAddress;
+	uint16_t count;
+	uint16_t index;
+};
+
+/*example of definition of the sparse map (SPARSE_REG_MAP=1), runs must be sorted by startAddress and must not overlap,
+  addresses 999-1009 are reserved for the special registers*/
+//const struct structHRRange RegRanges[H_RANGE_COUNT] =
+//{//		start	count	index
+//	{0,			10,		0		},	//communication and device registers
+//	{4000,		40,		10		},	//settings
+//	{40000,		10,		50		},	//calibration
+//};
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,224 @@
+/*MODBUS.hpp*/
+#ifndef __MODBUS_HPP
+#define __MODBUS_HPP
+
+/*
+ * C++17 front-end for the register map. The map is a constexpr table that is checked while compiling,
+ * the C library links against the same RegVirtAddr[] symbol, so MBR_Init_Modbus()/MBR_Check_For_Request()
+ * and the rest of MODBUS.c are used unchanged.
+ *
+ * usage (in one .cpp file):
+ *	#include "MODBUS.hpp"
+ *	MBR_REGISTER_MAP
+ *	({//		addr	r/w		sgn 	min 	max 	def
+ *		{0x01,	0,		0,		1,		247,	1		},	//1		Device slave address
+ *		...
+ *	});
+ *
+ * Virtual addresses have to fit virt_addr_t (0xA001 is a narrowing error in the 8-bit mode).
+ * With COMPILED_REG_MAP=1 the macro also generates RegChecks for the write handlers of MODBUS.c: the writable and range
+ * masks and a table with the limit check of every register, compiled with its min/max as constants.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "MODBUS.h"
+
+namespace mbr
+{
+
+template<std::size_t N> using Register_Table = struct structHRVA[N];
+
+/*same rules as Check_Register_Value() in MODBUS.c*/
+constexpr bool In_Limits(const struct structHRVA &reg, uint16_t value)
+{
+	if(reg.signedUnsigned)	//signed
+	{
+		return (int16_t)reg.Minimum <= (int16_t)value && (int16_t)value <= (int16_t)reg.Maximum;
+	}
+	return reg.Minimum <= value && value <= reg.Maximum;
+}
+
+/*every writable register has its default value inside its limits*/
+template<std::size_t N>
+constexpr bool Defaults_In_Limits(const Register_Table<N> &map)
+{
+	for(std::size_t i = 0; i < N; i++)
+	{
+		if(map[i].RW == 0 && !In_Limits(map[i], map[i].DefaultValue))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*every used register has its own virtual address (the persistence key), address 0 marks an unused entry*/
+template<std::size_t N>
+constexpr bool Unique_Virtual_Addresses(const Register_Table<N> &map)
+{
+	for(std::size_t i = 0; i < N; i++)
+	{
+		for(std::size_t j = i + 1; j < N; j++)
+		{
+			if(map[i].RW != 2 && map[i].virtualAddress != 0 && map[i].virtualAddress == map[j].virtualAddress && map[j].RW != 2)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*0-RW, 1-RO, 2-NA*/
+template<std::size_t N>
+constexpr bool Valid_Access(const Register_Table<N> &map)
+{
+	for(std::size_t i = 0; i < N; i++)
+	{
+		if(map[i].RW > 2)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*bit i is set when holding register i can be written by the master*/
+template<std::size_t N>
+constexpr std::array<uint32_t, (N + 31) / 32> Writable_Mask(const Register_Table<N> &map)
+{
+	std::array<uint32_t, (N + 31) / 32> mask{};
+
+	for(std::size_t i = 0; i < N; i++)
+	{
+		if(map[i].RW == 0)
+		{
+			mask[i / 32] |= 1UL << (i % 32);
+		}
+	}
+	return mask;
+}
+
+/*bit i is set when register i has a real range (writes have to be checked against min/max)*/
+template<std::size_t N>
+constexpr std::array<uint32_t, (N + 31) / 32> Range_Mask(const Register_Table<N> &map)
+{
+	std::array<uint32_t, (N + 31) / 32> mask{};
+
+	for(std::size_t i = 0; i < N; i++)
+	{
+		const bool full_range = map[i].signedUnsigned ? (map[i].Minimum == 0x8000 && map[i].Maximum == 0x7FFF)
+				: (map[i].Minimum == 0 && map[i].Maximum == 0xFFFF);
+		if(map[i].RW == 0 && !full_range)
+		{
+			mask[i / 32] |= 1UL << (i % 32);
+		}
+	}
+	return mask;
+}
+
+/*limit check with the constant min/max, registers with the same limits share one instance*/
+template<bool Signed, uint16_t Minimum, uint16_t Maximum>
+uint8_t Check_Limits(uint16_t value)
+{
+	if(Signed)
+	{
+		return ((int16_t)Minimum <= (int16_t)value && (int16_t)value <= (int16_t)Maximum) ? 0 : 0x03;
+	}
+	return (Minimum <= value && value <= Maximum) ? 0 : 0x03;
+}
+
+/*RegChecks of MODBUS.c: the masks and the dispatch table, registers without a range have no check*/
+template<const Register_Table<H_REG_COUNT> &Map, std::size_t... I>
+constexpr struct structRegChecks Compile_Checks(std::index_sequence<I...>)
+{
+	constexpr auto writable = Writable_Mask(Map);
+	constexpr auto ranged = Range_Mask(Map);
+	struct structRegChecks checks{};
+
+	for(std::size_t i = 0; i < writable.size(); i++)
+	{
+		checks.writable[i] = writable[i];
+		checks.ranged[i] = ranged[i];
+	}
+	((checks.check_value[I] = ((ranged[I / 32] >> (I % 32)) & 1)
+			? &Check_Limits<Map[I].signedUnsigned != 0, Map[I].Minimum, Map[I].Maximum> : nullptr), ...);
+	return checks;
+}
+
+/*runs are sorted, do not overlap and stay inside uint_hold_reg[]*/
+template<std::size_t N>
+constexpr bool Valid_Ranges(const struct structHRRange (&ranges)[N])
+{
+	for(std::size_t i = 0; i < N; i++)
+	{
+		if(ranges[i].count == 0 || ranges[i].index + ranges[i].count > H_REG_COUNT
+				|| (uint32_t)ranges[i].startAddress + ranges[i].count > 0x10000)
+		{
+			return false;
+		}
+		if(i > 0 && (uint32_t)ranges[i-1].startAddress + ranges[i-1].count > ranges[i].startAddress)
+		{
+			return false;
+		}
+		if(ranges[i].startAddress < 1010 && ranges[i].startAddress + ranges[i].count > 999)	//special registers window
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*both words are writable holding registers, not shared with another 32-bit value*/
+template<std::size_t N, std::size_t M>
+constexpr bool Valid_Wide_Registers(const struct structHRWide (&wide)[N], const Register_Table<M> &map)
+{
+	for(std::size_t i = 0; i < N; i++)
+	{
+		if(std::size_t(wide[i].index) + 2 > M || map[wide[i].index].RW != 0 || map[wide[i].index + 1].RW != 0 || wide[i].type > wide_f32)
+		{
+			return false;
+		}
+		for(std::size_t j = i + 1; j < N; j++)
+		{
+			if(wide[j].index + 1 >= wide[i].index && wide[j].index <= wide[i].index + 1)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+}	//namespace mbr
+
+#if COMPILED_REG_MAP
+#define MBR_COMPILED_CHECKS \
+	extern "C" { extern constexpr struct structRegChecks RegChecks = mbr::Compile_Checks<RegVirtAddr>(std::make_index_sequence<H_REG_COUNT>()); }
+#else
+#define MBR_COMPILED_CHECKS
+#endif
+
+/*defines RegVirtAddr[] (and RegChecks with COMPILED_REG_MAP=1) for MODBUS.c and checks it while compiling*/
+#define MBR_REGISTER_MAP(...) \
+	extern "C" { extern constexpr struct structHRVA RegVirtAddr[H_REG_COUNT] = __VA_ARGS__; } \
+	MBR_COMPILED_CHECKS \
+	static_assert(mbr::Valid_Access(RegVirtAddr), "RegVirtAddr: RW has to be 0, 1 or 2"); \
+	static_assert(mbr::Defaults_In_Limits(RegVirtAddr), "RegVirtAddr: default value outside of min/max"); \
+	static_assert(mbr::Unique_Virtual_Addresses(RegVirtAddr), "RegVirtAddr: overlapping virtual addresses")
+
+/*defines RegRanges[] (SPARSE_REG_MAP=1) and checks it while compiling*/
+#define MBR_REGISTER_RANGES(...) \
+	extern "C" { extern constexpr struct structHRRange RegRanges[H_RANGE_COUNT] = __VA_ARGS__; } \
+	static_assert(mbr::Valid_Ranges(RegRanges), "RegRanges: runs unsorted, overlapping, out of uint_hold_reg[] or in 999-1009")
+
+/*defines RegWide[] (W_REG_COUNT > 0) and checks it while compiling, use after MBR_REGISTER_MAP*/
+#define MBR_WIDE_REGISTERS(...) \
+	extern "C" { extern constexpr struct structHRWide RegWide[W_REG_COUNT] = __VA_ARGS__; } \
+	static_assert(mbr::Valid_Wide_Registers(RegWide, RegVirtAddr), "RegWide: words not writable, out of range or shared")
+
+#endif
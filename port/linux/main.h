@@ -0,0 +1,235 @@
+/*main.h of the Linux port: the part of the STM32 HAL used by MODBUS.c, emulated over termios*/
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __weak					__attribute__((weak))
+#define UNUSED(X)				(void)X
+#define __DMB()					__sync_synchronize()
+
+typedef enum
+{
+	HAL_OK = 0x00U,
+	HAL_ERROR = 0x01U,
+	HAL_BUSY = 0x02U,
+	HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+/*peripheral registers are plain memory, mbr_port.c updates them the way the hardware would*/
+typedef struct
+{
+	volatile uint32_t CCR;
+	volatile uint32_t CNDTR;	//bytes left to the end of the receive buffer
+} DMA_Channel_TypeDef;
+
+typedef struct
+{
+	DMA_Channel_TypeDef *Instance;
+} DMA_HandleTypeDef;
+
+typedef struct
+{
+	volatile uint32_t IER;	//interrupt enable bits (CR1 on the hardware, the name is taken by termios.h)
+	volatile uint32_t RTOR;
+	volatile uint32_t ISR;
+} USART_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t IDR;
+	volatile uint32_t ODR;
+	volatile uint32_t BSRR;
+	volatile uint32_t BRR;
+} GPIO_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t CTRL;
+	volatile uint32_t LOAD;
+	volatile uint32_t VAL;
+	volatile uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct
+{
+	volatile uint32_t ICSR;	//PENDSTSET is never set: HAL_GetTick() is always current
+} SCB_Type;
+
+#define SCB_ICSR_PENDSTSET_Msk		(1UL << 26)
+
+typedef struct
+{
+	volatile uint32_t CNT;
+	volatile uint32_t ARR;
+} TIM_TypeDef;
+
+typedef struct
+{
+	TIM_TypeDef *Instance;	//counts microseconds
+	/*port state*/
+	uint8_t Running;
+	uint64_t StartTime;	//ns, CLOCK_MONOTONIC when CNT was 0
+} TIM_HandleTypeDef;
+
+typedef struct
+{
+	uint32_t BaudRate;
+	uint32_t WordLength;
+	uint32_t StopBits;
+	uint32_t Parity;
+	uint32_t Mode;
+	uint32_t HwFlowCtl;
+	uint32_t OverSampling;
+} UART_InitTypeDef;
+
+typedef struct
+{
+	USART_TypeDef *Instance;
+	UART_InitTypeDef Init;
+	DMA_HandleTypeDef *hdmarx;
+	volatile uint32_t ErrorCode;
+	/*port state*/
+	int fd;	//-1 = virtual line
+	void (*Transmit)(const uint8_t *frame, uint16_t size);	//virtual line: receives every transmitted frame
+	uint8_t *pRxBuffPtr;
+	uint16_t RxXferSize;
+	uint16_t RxPosition;	//next byte of pRxBuffPtr written by the "DMA"
+	uint8_t RxActive;	//HAL_UART_Receive_DMA() was called and the reception was not stopped
+	uint8_t RxFrameOpen;	//bytes received since the last receiver timeout
+	uint32_t ReceiverTimeout;	//bits, from HAL_UART_ReceiverTimeout_Config()
+	uint8_t DEEnabled;	//HAL_RS485Ex_Init() was called: the USART drives DE
+	uint8_t DEAssertionTime;	//1/16 bit, DE rise to the start bit
+	uint8_t DEDeassertionTime;	//1/16 bit, last stop bit to DE fall
+	uint64_t LastRxTime;	//ns, CLOCK_MONOTONIC
+	DMA_HandleTypeDef hdma_rx;
+	DMA_Channel_TypeDef dma_rx_channel;
+} UART_HandleTypeDef;
+
+#define HAL_UART_ERROR_NONE			0x00000000U
+#define HAL_UART_ERROR_PE			0x00000001U
+#define HAL_UART_ERROR_NE			0x00000002U
+#define HAL_UART_ERROR_FE			0x00000004U
+#define HAL_UART_ERROR_ORE			0x00000008U
+#define HAL_UART_ERROR_DMA			0x00000010U
+#define HAL_UART_ERROR_RTO			0x00000020U
+
+#define UART_WORDLENGTH_8B			0x00000000U
+#define UART_WORDLENGTH_9B			0x00001000U	//8 data bits + parity
+#define UART_PARITY_NONE			0x00000000U
+#define UART_PARITY_EVEN			0x00000400U
+#define UART_PARITY_ODD				0x00000600U
+#define UART_STOPBITS_1				0x00000000U
+#define UART_STOPBITS_2				0x00002000U
+#define UART_MODE_TX_RX				0x0000000CU
+#define UART_HWCONTROL_NONE			0x00000000U
+#define UART_OVERSAMPLING_16		0x00000000U
+#define UART_DE_POLARITY_HIGH		0x00000000U
+
+#define UART_FLAG_RTOF				0x00000800U
+#define UART_FLAG_IDLE				0x00000010U
+#define UART_CLEAR_RTOF				0x00000800U
+#define UART_CLEAR_IDLEF			0x00000010U
+#define UART_IT_IDLE				0x00000010U
+
+#define __HAL_UART_GET_FLAG(__HANDLE__, __FLAG__)	(((__HANDLE__)->Instance->ISR & (__FLAG__)) == (__FLAG__))
+#define __HAL_UART_CLEAR_FLAG(__HANDLE__, __FLAG__)	((__HANDLE__)->Instance->ISR &= ~(__FLAG__))
+#define __HAL_UART_CLEAR_IDLEFLAG(__HANDLE__)		__HAL_UART_CLEAR_FLAG((__HANDLE__), UART_CLEAR_IDLEF)
+#define __HAL_UART_ENABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->IER |= (__INTERRUPT__))
+
+/*flash: a file mapped at FLASH_BASE by MBR_Port_Open_Flash(), programmed half-words can only be cleared to 0 until erased*/
+#define FLASH_BASE					0x08000000UL
+#define PORT_FLASH_SIZE				0x20000U
+#define FLASH_PAGE_SIZE				0x800U
+#define FLASH_TYPEERASE_PAGES		0x00U
+#define FLASH_TYPEPROGRAM_HALFWORD	0x01U
+#define FLASH_TYPEPROGRAM_WORD		0x02U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD	0x03U
+#define FLASH_BANK_1				0x01U
+
+typedef struct
+{
+	uint32_t TypeErase;
+	uint32_t Banks;
+	uint32_t PageAddress;
+	uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+#define __HAL_TIM_SET_COUNTER(__HANDLE__, __COUNTER__)	Port_TIM_Set_Counter((__HANDLE__), (__COUNTER__))
+#define __HAL_TIM_SET_AUTORELOAD(__HANDLE__, __AUTORELOAD__)	((__HANDLE__)->Instance->ARR = (__AUTORELOAD__))
+
+#define GPIO_PIN_10					0x0400U
+#define GPIO_PIN_12					0x1000U
+#define GPIO_PIN_14					0x4000U
+#define GPIO_PIN_15					0x8000U
+
+/*board pins, nothing is driven: use MBR_Switch_DE_Callback() for an RTS based direction control*/
+#define USART1_RX_Pin				GPIO_PIN_10
+#define USART1_RX_GPIO_Port			GPIOA
+#define USART1_DE_Pin				GPIO_PIN_12
+#define USART1_DE_GPIO_Port			GPIOA
+#define USART1_NBT_Pin				GPIO_PIN_15
+#define USART1_NBT_GPIO_Port		GPIOA
+
+extern USART_TypeDef port_usart1;
+extern GPIO_TypeDef port_gpioa;
+extern SysTick_Type port_systick;
+extern SCB_Type port_scb;
+extern uint16_t port_uid[6];
+extern uint16_t port_pid[5];
+extern uint32_t SystemCoreClock;
+extern uint32_t port_flash_program_us;	//time of one half-word program, the caller waits as for the real flash (0 = none)
+extern uint32_t port_flash_erase_us;	//time of one page erase
+
+#define USART1						(&port_usart1)
+#define GPIOA						(&port_gpioa)
+#define SysTick						(&port_systick)
+#define SCB							(&port_scb)
+#define UID_BASE					((uintptr_t)port_uid)	//filled from /etc/machine-id
+#define PID_ADDRESS					((uintptr_t)port_pid)
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+void HAL_NVIC_SystemReset(void);	//exits the process, the service manager starts it again
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_RS485Ex_Init(UART_HandleTypeDef *huart, uint32_t Polarity, uint32_t AssertionTime, uint32_t DeassertionTime);
+void HAL_UART_ReceiverTimeout_Config(UART_HandleTypeDef *huart, uint32_t TimeoutValue);
+HAL_StatusTypeDef HAL_UART_EnableReceiverTimeout(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim);
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim);	//weak ref, called from MBR_Port_Poll() when the running timer expires
+void Port_TIM_Set_Counter(TIM_HandleTypeDef *htim, uint32_t Counter);
+
+/*PORT FUNCTIONS*/
+int MBR_Port_Open(UART_HandleTypeDef *huart, const char *device);	//call before MBR_Init_Modbus(), starts the 1 ms tick thread, returns 0 or -1 (errno is set)
+int MBR_Port_Open_Virtual(UART_HandleTypeDef *huart, void (*transmit)(const uint8_t *frame, uint16_t size));	//no serial device and no tick thread: requests come from MBR_Port_Inject(), responses go to transmit
+void MBR_Port_Inject(UART_HandleTypeDef *huart, const uint8_t *frame, uint16_t size);	//virtual line: the frame is received at once and ends at the next MBR_Port_Poll()
+int MBR_Port_Open_Flash(const char *path);	//map the flash image file (created erased) at FLASH_BASE, call before MBR_Init_Modbus(), returns 0 or -1 (errno is set)
+void MBR_Port_Poll(UART_HandleTypeDef *huart, uint32_t timeout_ms);	//call before every MBR_Check_For_Request(), waits for serial data at most timeout_ms
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
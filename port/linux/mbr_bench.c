@@ -0,0 +1,383 @@
+/*mbr_bench.c - microbenchmark of the request path on the host: CRC check of the request, the handler, the response
+  encoding and its CRC (Check_Frame() of MODBUS.c, the line and the transmission are not included).
+
+  mbr_bench [-a] [-m] [-i batches] > results.csv
+
+  MODBUS.c is included to reach its private functions. Every case is checked once (response or no response, no exception),
+  then timed in batches of BATCH_SIZE requests: min/p50/p99 are taken over the batch averages, in ns per request.
+  The autoassignment commands 100-103 and 105 start every request in the state they expect (cmd101 confirms the
+  UID, cmd102 assigns the address the device already has), chk_regs is one Check_Modbus_Registers() pass over the
+  register map as MBR_Init_Modbus() runs it, every value inside its limits.
+  -a runs every register count from 1 to 125 instead of the powers of two. Built with RESPONSE_CACHE (mbr_bench_cache) the
+  repeated reads are answered from the cache, -m calls MBR_Invalidate_Cache() before every request (every read misses).*/
+#define _GNU_SOURCE
+#include "MODBUS.c"
+#include "mbr_bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_SIZE			64
+#define WARMUP_BATCHES		16	//caches and branch predictors, not reported
+#define SLAVE_ADDRESS		1
+
+struct bench_case_s
+{
+	const char *handler;
+	uint16_t registers;
+	const char *map;	//unsigned, signed or - (reads)
+	const char *restrictions;	//absent, present or -
+	uint8_t broadcast;
+	uint8_t silent;	//no response expected besides broadcast: commands 100 and 103, chk_regs
+	uint8_t autoassignment_status;	//flg_autoassignment_status the command expects, 0 = not an autoassignment command
+	uint8_t request[MODBUS_BUFFER_SIZE];
+	uint16_t length;
+	void (*run)(const struct bench_case_s *bench_case);	//one timed iteration
+};
+
+static UART_HandleTypeDef huart;
+static uint8_t buf_response[MODBUS_BUFFER_SIZE];
+static uint16_t len_response;
+static uint32_t cnt_batches = 2000;
+static uint8_t flg_all_counts;
+static uint8_t flg_cache_misses;
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static void Transmit(const uint8_t *frame, uint16_t size);
+static uint8_t Read_Register(uint16_t address, uint16_t *data);
+static uint8_t Write_Register(uint16_t address, uint16_t data);
+static uint8_t Restriction(uint16_t register_address, uint16_t register_data);
+static void Run_Read_Cases(uint8_t function_code);
+static void Run_Write_Cases(uint8_t function_code);
+static void Run_Autoassignment_Cases(void);
+static void Run_Register_Check_Case(void);
+static void Run_Request(const struct bench_case_s *bench_case);
+static void Run_Register_Check(const struct bench_case_s *bench_case);
+static void Run_Case(struct bench_case_s *bench_case);
+static uint8_t Check_Case(struct bench_case_s *bench_case);
+static uint16_t Next_Count(uint16_t count, uint16_t limit);
+static void Put_Word(uint8_t *dst, uint16_t value);
+static uint16_t Finish_Request(uint8_t *request, uint16_t len);
+static uint64_t Bench_Now(void);
+static int Compare_Double(const void *a, const void *b);
+
+
+int main(int argc, char **argv)
+{
+	int option;
+
+	while((option = getopt(argc, argv, "ami:")) != -1)
+	{
+		switch(option)
+		{
+		case 'a':	flg_all_counts = 1;	break;
+		case 'm':	flg_cache_misses = 1;	break;
+		case 'i':	cnt_batches = strtoul(optarg, NULL, 0);	break;
+		default:
+			fprintf(stderr, "usage: %s [-a] [-m] [-i batches]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(cnt_batches == 0)
+	{
+		cnt_batches = 1;
+	}
+
+	if(MBR_Port_Open_Virtual(&huart, Transmit))
+	{
+		perror("mbr_bench");
+		return 1;
+	}
+	MBR_Init_Modbus(&huart, Read_Register, Write_Register);
+
+	printf("handler,registers,map,restrictions,addressing,iterations,min_ns,p50_ns,p99_ns\n");
+	Run_Read_Cases(read_holding_registers);
+	Run_Read_Cases(read_input_registers);
+	Run_Write_Cases(write_single_register);
+	Run_Write_Cases(write_multiple_registers);
+	Run_Autoassignment_Cases();
+	Run_Register_Check_Case();
+	return 0;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+static void Transmit(const uint8_t *frame, uint16_t size)
+{
+	memcpy(buf_response, frame, size);
+	len_response = size;
+}
+
+/*first start: the library writes the default values, later reads return them*/
+static uint8_t Read_Register(uint16_t address, uint16_t *data)
+{
+	if(address >= H_REG_COUNT)
+	{
+		return 1;
+	}
+	*data = RegVirtAddr[address].DefaultValue;
+	return 0;
+}
+
+static uint8_t Write_Register(uint16_t address, uint16_t data)
+{
+	UNUSED(address);
+	UNUSED(data);
+	return 0;
+}
+
+/*a typical application rule: the signed block must not go below the unsigned register it is paired with*/
+static uint8_t Restriction(uint16_t register_address, uint16_t register_data)
+{
+	if(register_address >= BENCH_SIGNED_START)
+	{
+		return (int16_t)register_data < -(int16_t)uint_hold_reg[register_address - (BENCH_SIGNED_START - BENCH_UNSIGNED_START)];
+	}
+	return register_address == 9 && register_data > 1;
+}
+
+static void Run_Read_Cases(uint8_t function_code)
+{
+	struct bench_case_s bench_case = {.handler = (function_code == read_holding_registers) ? "fc03" : "fc04", .map = "-", .restrictions = "-",
+			.run = Run_Request};
+
+	for(uint16_t count = 1; count <= MAX_READ_REGISTERS; count = Next_Count(count, MAX_READ_REGISTERS))
+	{
+		for(uint8_t broadcast = 0; broadcast < 2; broadcast++)
+		{
+			uint8_t *request = bench_case.request;
+
+			request[0] = broadcast ? 0 : SLAVE_ADDRESS;
+			request[1] = function_code;
+			Put_Word(&request[2], (function_code == read_holding_registers) ? BENCH_UNSIGNED_START : 0);
+			Put_Word(&request[4], count);
+			bench_case.length = Finish_Request(request, 6);
+			bench_case.registers = count;
+			bench_case.broadcast = broadcast;
+			Run_Case(&bench_case);
+		}
+	}
+}
+
+static void Run_Write_Cases(uint8_t function_code)
+{
+	struct bench_case_s bench_case = {.handler = (function_code == write_single_register) ? "fc06" : "fc16", .run = Run_Request};
+	uint16_t limit = (function_code == write_single_register) ? 1 : MAX_WRITE_REGISTERS;
+
+	for(uint16_t count = 1; count <= limit; count = Next_Count(count, limit))
+	{
+		for(uint8_t is_signed = 0; is_signed < 2; is_signed++)
+		{
+			for(uint8_t restricted = 0; restricted < 2; restricted++)
+			{
+				for(uint8_t broadcast = 0; broadcast < 2; broadcast++)
+				{
+					uint8_t *request = bench_case.request;
+					uint16_t start = is_signed ? BENCH_SIGNED_START : BENCH_UNSIGNED_START;
+					uint16_t value = is_signed ? (uint16_t)-5 : 50;	//inside the limits and allowed by Restriction()
+
+					request[0] = broadcast ? 0 : SLAVE_ADDRESS;
+					request[1] = function_code;
+					Put_Word(&request[2], start);
+					if(function_code == write_single_register)
+					{
+						Put_Word(&request[4], value);
+						bench_case.length = Finish_Request(request, 6);
+					}
+					else
+					{
+						Put_Word(&request[4], count);
+						request[6] = count * 2;
+						for(uint16_t i = 0; i < count; i++)
+						{
+							Put_Word(&request[7 + 2*i], value);
+						}
+						bench_case.length = Finish_Request(request, 7 + 2*count);
+					}
+					bench_case.registers = count;
+					bench_case.map = is_signed ? "signed" : "unsigned";
+					bench_case.restrictions = restricted ? "present" : "absent";
+					bench_case.broadcast = broadcast;
+					bench_restriction = restricted ? Restriction : NULL;
+					Run_Case(&bench_case);
+				}
+			}
+		}
+	}
+	bench_restriction = NULL;
+}
+
+/*requests as mbr_enum_sim sends them, with the UID, production ID and device type of this device*/
+static void Run_Autoassignment_Cases(void)
+{
+	struct bench_case_s bench_case = {.map = "-", .restrictions = "-", .run = Run_Request};
+	uint8_t *request = bench_case.request;
+
+	memset(request, 0xAA, sizeof(bench_case.request));	//command 100 expects AA AA AA AA, 101 and 102 ignore bytes 2-6
+	request[0] = SLAVE_ADDRESS;
+
+	bench_case.handler = "cmd103";	//go to autoassignment mode, no response
+	bench_case.silent = 1;
+	request[1] = 103;
+	bench_case.length = Finish_Request(request, 6);
+	Run_Case(&bench_case);
+
+	bench_case.handler = "cmd100";	//the recognition answer is only scheduled here
+	bench_case.autoassignment_status = 100;
+	request[1] = 100;
+	bench_case.length = Finish_Request(request, 6);
+	Run_Case(&bench_case);
+
+	bench_case.handler = "cmd105";	//UID search with the whole UID as the prefix
+	bench_case.silent = 0;
+	request[1] = 105;
+	request[2] = 96;
+	Encode_Words(uint_spec_reg, 6, &request[3]);
+	bench_case.length = Finish_Request(request, 15);
+	Run_Case(&bench_case);
+
+	bench_case.handler = "cmd101";	//confirmation
+	bench_case.autoassignment_status = 101;
+	request[1] = 101;
+	Encode_Words(uint_spec_reg, 11, &request[7]);
+	Put_Word(&request[29], uint_hold_reg[3]);	//device type
+	bench_case.length = Finish_Request(request, 31);
+	Run_Case(&bench_case);
+
+	bench_case.handler = "cmd102";	//new address, the same one: the next request is still addressed to the device
+	bench_case.autoassignment_status = 102;
+	request[1] = 102;
+	request[8] = SLAVE_ADDRESS;
+	Encode_Words(uint_spec_reg, 11, &request[9]);
+	Put_Word(&request[31], uint_hold_reg[3]);
+	bench_case.length = Finish_Request(request, 33);
+	Run_Case(&bench_case);
+
+	flg_autoassignment_mode = 0;
+	flg_autoassignment_status = 0;
+}
+
+static void Run_Register_Check_Case(void)
+{
+	struct bench_case_s bench_case = {.handler = "chk_regs", .registers = H_REG_COUNT, .map = "-", .restrictions = "-",
+			.silent = 1, .run = Run_Register_Check};
+
+	Run_Case(&bench_case);
+}
+
+static void Run_Request(const struct bench_case_s *bench_case)
+{
+	memcpy(buf_modbus, bench_case->request, bench_case->length);	//the response overwrites the request
+	len_modbus_frame = bench_case->length;
+	if(bench_case->autoassignment_status)
+	{
+		flg_autoassignment_mode = 1;
+		flg_autoassignment_status = bench_case->autoassignment_status;
+	}
+#if RESPONSE_CACHE
+	if(flg_cache_misses)
+	{
+		MBR_Invalidate_Cache();
+	}
+#endif
+	Check_Frame();
+}
+
+static void Run_Register_Check(const struct bench_case_s *bench_case)
+{
+	UNUSED(bench_case);
+	Check_Modbus_Registers();
+}
+
+static void Run_Case(struct bench_case_s *bench_case)
+{
+	double *batch_ns = malloc(cnt_batches * sizeof(double));
+	uint64_t start;
+
+	if(batch_ns == NULL || Check_Case(bench_case))
+	{
+		exit(1);
+	}
+
+	for(int32_t batch = -WARMUP_BATCHES; batch < (int32_t)cnt_batches; batch++)
+	{
+		start = Bench_Now();
+		for(uint32_t i = 0; i < BATCH_SIZE; i++)
+		{
+			bench_case->run(bench_case);
+		}
+		if(batch >= 0)
+		{
+			batch_ns[batch] = (double)(Bench_Now() - start) / BATCH_SIZE;
+		}
+	}
+
+	qsort(batch_ns, cnt_batches, sizeof(double), Compare_Double);
+	printf("%s,%u,%s,%s,%s,%u,%.1f,%.1f,%.1f\n", bench_case->handler, bench_case->registers, bench_case->map,
+			bench_case->restrictions, (bench_case->run != Run_Request) ? "-" : bench_case->broadcast ? "broadcast" : "addressed",
+			cnt_batches * BATCH_SIZE,
+			batch_ns[0], batch_ns[cnt_batches / 2], batch_ns[(uint64_t)cnt_batches * 99 / 100]);
+	free(batch_ns);
+}
+
+/*a benchmark of an exception or of a lost response would measure the wrong path*/
+static uint8_t Check_Case(struct bench_case_s *bench_case)
+{
+	len_response = 0;
+	bench_case->run(bench_case);
+
+	if((bench_case->broadcast || bench_case->silent) ? (len_response != 0) : (len_response < 5 || buf_response[1] != bench_case->request[1]))
+	{
+		fprintf(stderr, "mbr_bench: %s, %u registers, %s: unexpected response (%u bytes, function code 0x%02X)\n",
+				bench_case->handler, bench_case->registers, bench_case->broadcast ? "broadcast" : "addressed",
+				len_response, len_response ? buf_response[1] : 0);
+		return 1;
+	}
+	return 0;
+}
+
+static uint16_t Next_Count(uint16_t count, uint16_t limit)
+{
+	if(flg_all_counts)
+	{
+		return count + 1;
+	}
+	if(count < limit && count * 2 > limit)	//the largest request comes last
+	{
+		return limit;
+	}
+	return count * 2;
+}
+
+static void Put_Word(uint8_t *dst, uint16_t value)
+{
+	dst[0] = value>>8;
+	dst[1] = value;
+}
+
+static uint16_t Finish_Request(uint8_t *request, uint16_t len)
+{
+	uint16_t crc16 = Calculate_CRC16(request, len);
+
+	request[len] = crc16;
+	request[len+1] = crc16>>8;
+	return len + 2;
+}
+
+static uint64_t Bench_Now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int Compare_Double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,35 @@
+/*mbr_bench.h - shared by mbr_bench.c, mbr_replay.c and their register map (mbr_bench_map.c, mbr_bench_map.cpp)*/
+#ifndef __MBR_BENCH_H
+#define __MBR_BENCH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BENCH_UNSIGNED_START	10	//first of 123 unsigned holding registers (MAX_WRITE_REGISTERS)
+#define BENCH_SIGNED_START		133	//first of 123 signed holding registers
+
+/*the 246 registers after the communication registers, each with its own virtual address: 0x0B-0xFF and 0x07 (register 7 is NA)*/
+#define BENCH_UNSIGNED(a)		{(a),	0,		0,		0,		60000,	100		}
+#define BENCH_SIGNED(a)			{(a),	0,		1,		(uint16_t)-1000,	1000,	(uint16_t)-10	}
+#define BENCH_X2(reg, a)		reg(a), reg((a) + 1)
+#define BENCH_X8(reg, a)		BENCH_X2(reg, a), BENCH_X2(reg, (a) + 2), BENCH_X2(reg, (a) + 4), BENCH_X2(reg, (a) + 6)
+#define BENCH_X32(reg, a)		BENCH_X8(reg, a), BENCH_X8(reg, (a) + 8), BENCH_X8(reg, (a) + 16), BENCH_X8(reg, (a) + 24)
+#define BENCH_REGISTERS \
+	BENCH_X32(BENCH_UNSIGNED, 0x0B), BENCH_X32(BENCH_UNSIGNED, 0x2B), BENCH_X32(BENCH_UNSIGNED, 0x4B), \
+	BENCH_X8(BENCH_UNSIGNED, 0x6B), BENCH_X8(BENCH_UNSIGNED, 0x73), BENCH_X8(BENCH_UNSIGNED, 0x7B), \
+	BENCH_X2(BENCH_UNSIGNED, 0x83), BENCH_UNSIGNED(0x85), \
+	BENCH_X32(BENCH_SIGNED, 0x86), BENCH_X32(BENCH_SIGNED, 0xA6), BENCH_X32(BENCH_SIGNED, 0xC6), \
+	BENCH_X8(BENCH_SIGNED, 0xE6), BENCH_X8(BENCH_SIGNED, 0xEE), BENCH_X8(BENCH_SIGNED, 0xF6), \
+	BENCH_X2(BENCH_SIGNED, 0xFE), BENCH_SIGNED(0x07)
+
+extern uint8_t (*bench_restriction)(uint16_t register_address, uint16_t register_data);	//MBR_Check_Restrictions_Callback() of the application, NULL = none
+extern void (*bench_update)(uint16_t register_address, uint16_t register_data);	//MBR_Register_Update_Callback() of the application, NULL = none
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
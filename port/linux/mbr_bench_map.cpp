@@ -0,0 +1,43 @@
+/*mbr_bench_map.cpp - the register map of mbr_bench_map.c written with MBR_REGISTER_MAP of MODBUS.hpp, for mbr_bench_compiled
+  (COMPILED_REG_MAP=1): the write handlers use the generated masks and limit checks instead of RegVirtAddr[].*/
+#include "MODBUS.hpp"
+#include "mbr_bench.h"
+
+#define DEV_TYPE	1
+#define DEV_HW		1
+#define DEV_FW		1
+
+uint8_t (*bench_restriction)(uint16_t register_address, uint16_t register_data);	//NULL = no application restrictions
+void (*bench_update)(uint16_t register_address, uint16_t register_data);	//NULL = nothing to do on updates
+
+MBR_REGISTER_MAP
+({//		addr	r/w		sgn 	min 	max 	def
+	{0x01,		0,		0,		1,		247,	1		},	//1		Device slave address
+	{0x02,		0,		0,		0,		6,		2		},	//2		Modbus bound rate
+	{0x03,		0,		0,		0,		2,		1		},	//3		Modbus parity
+	{0x04,		1,		0,		0,		0,		DEV_TYPE},	//4		Device type
+	{0x05,		1,		0,		0,		0,		DEV_HW	},	//5		HW version
+	{0x06,		1,		0,		0,		0,		DEV_FW	},	//6		FW version
+	{0x00,		2,		0,		0,		0,		0		},	//7		NA
+	{0x08,		0,		0,		0,		60,		0		},	//8		Modbus safety timeout
+	{0x09,		0,		0,		0,		1,		0		},	//9		NBT
+	{0x0A,		0,		0,		0,		1,		0		},	//10	Modbus reset
+	BENCH_REGISTERS	//11-133 unsigned, 134-256 signed
+});
+
+extern "C" uint8_t MBR_Check_Restrictions_Callback(uint16_t register_address, uint16_t register_data)
+{
+	if(bench_restriction == NULL)
+	{
+		return 0;
+	}
+	return bench_restriction(register_address, register_data);
+}
+
+extern "C" void MBR_Register_Update_Callback(uint16_t register_address, uint16_t register_data)
+{
+	if(bench_update != NULL)
+	{
+		bench_update(register_address, register_data);
+	}
+}
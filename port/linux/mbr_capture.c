@@ -0,0 +1,274 @@
+/*mbr_capture.c - drain the bus capture ring of a slave (BUS_CAPTURE=1, FC65) and turn the dump into a pcap file
+  with the bus occupancy per slave address and a histogram of the idle gaps between frames.
+
+  mbr_capture [-b baud] [-p parity] [-t seconds] drain <serial device> <slave address> <dump file>
+  mbr_capture [-b baud] [-c bits per character] convert <dump file> <pcap file>
+
+  The dump is the FC65 records as the slave keeps them: [tick 4 bytes][frame length 2 bytes][stored length 1 byte][bytes],
+  big-endian, the tick is HAL_GetTick() at the receiver timeout (t3.5 after the last byte). The pcap link type is
+  DLT_USER0 (147), Wireshark decodes it with the "mbrtu" protocol in Preferences > Protocols > DLT_USER.*/
+#define _GNU_SOURCE
+#include "mbr_master.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_HEADER_SIZE			7
+#define DLT_USER0					147
+#define GAP_BUCKETS					12	//<1 ms, 1-2 ms, 2-4 ms ... 512-1024 ms, 1024 ms and more
+
+struct record_s
+{
+	uint32_t tick;
+	uint16_t length;
+	uint8_t stored;
+	uint8_t data[255];
+};
+
+struct slave_stats_s
+{
+	uint32_t frames;
+	uint32_t bytes;
+	uint64_t line_us;	//time the frames occupied the line
+};
+
+static uint32_t baud_rate = 19200;
+static uint8_t parity = 1;
+static uint8_t char_bits = 11;
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static int Drain(const char *device, uint8_t address, const char *dump_name, uint32_t seconds);
+static int Convert(const char *dump_name, const char *pcap_name);
+static int Own_Poll(const uint8_t *record, uint8_t address);
+static int Read_Record(FILE *dump, struct record_s *record);
+static void Write_Pcap_Record(FILE *pcap, const struct record_s *record);
+static uint32_t Gap_Bucket(int64_t gap_ms);
+static void Usage(const char *name);
+
+
+int main(int argc, char **argv)
+{
+	uint32_t seconds = 0;
+	int option;
+
+	while((option = getopt(argc, argv, "b:p:t:c:")) != -1)
+	{
+		switch(option)
+		{
+		case 'b':	baud_rate = strtoul(optarg, NULL, 0);	break;
+		case 'p':	parity = strtoul(optarg, NULL, 0);	break;
+		case 't':	seconds = strtoul(optarg, NULL, 0);	break;
+		case 'c':	char_bits = strtoul(optarg, NULL, 0);	break;
+		default:	Usage(argv[0]);	return 2;
+		}
+	}
+	if(baud_rate == 0 || char_bits == 0)
+	{
+		Usage(argv[0]);
+		return 2;
+	}
+
+	if(argc - optind == 4 && strcmp(argv[optind], "drain") == 0)
+	{
+		return Drain(argv[optind+1], strtoul(argv[optind+2], NULL, 0), argv[optind+3], seconds);
+	}
+	if(argc - optind == 3 && strcmp(argv[optind], "convert") == 0)
+	{
+		return Convert(argv[optind+1], argv[optind+2]);
+	}
+	Usage(argv[0]);
+	return 2;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+/*FC65 until the ring is empty, or polled every 100 ms for the given time*/
+static int Drain(const char *device, uint8_t address, const char *dump_name, uint32_t seconds)
+{
+	uint8_t request[4] = {address, 0x41};
+	uint8_t response[256];
+	uint32_t records = 0, dropped = 0;
+	time_t end = time(NULL) + seconds;
+	FILE *dump;
+	int fd, length;
+
+	fd = MBR_Master_Open(device, baud_rate, parity);
+	dump = fopen(dump_name, "ab");
+	if(fd < 0 || dump == NULL)
+	{
+		perror("mbr_capture");
+		return 1;
+	}
+
+	for(;;)
+	{
+		length = MBR_Master_Transact(fd, request, 2, response, sizeof(response), 200);
+		if(length <= 0 || response[1] != 0x41 || length < 7 || response[2] != length - 5)
+		{
+			fprintf(stderr, "mbr_capture: %s\n", (length == 0) ? "no response" : "bad response");
+			fclose(dump);
+			return 1;
+		}
+
+		dropped += (response[3]<<8) | response[4];
+		int bus_records = 0;
+		for(int position = 5; position + CAPTURE_HEADER_SIZE <= length - 2; )	//whole records only
+		{
+			int record_size = CAPTURE_HEADER_SIZE + response[position+6];
+			if(!Own_Poll(&response[position], address))	//the slave captures the FC65 polls of the drain too
+			{
+				fwrite(&response[position], 1, record_size, dump);
+				bus_records++;
+			}
+			position += record_size;
+		}
+		records += bus_records;
+
+		if(bus_records == 0)	//the ring is empty
+		{
+			if(time(NULL) >= end)
+			{
+				break;
+			}
+			usleep(100000);
+		}
+	}
+
+	fclose(dump);
+	fprintf(stderr, "%u records drained, %u dropped by the slave (ring full)\n", records, dropped);
+	return 0;
+}
+
+static int Convert(const char *dump_name, const char *pcap_name)
+{
+	static const uint32_t pcap_header[6] = {0xA1B2C3D4, 0x00040002, 0, 0, 65535, DLT_USER0};	//version 2.4, microseconds
+	struct slave_stats_s slaves[256] = {0};
+	uint32_t gaps[GAP_BUCKETS] = {0};
+	struct record_s record;
+	uint32_t frames = 0, first_tick = 0, last_tick = 0;
+	uint64_t line_us = 0, frame_us, first_frame_us = 0, previous_end_us = 0;
+	FILE *dump = fopen(dump_name, "rb");
+	FILE *pcap = fopen(pcap_name, "wb");
+
+	if(dump == NULL || pcap == NULL)
+	{
+		perror("mbr_capture");
+		return 1;
+	}
+	fwrite(pcap_header, sizeof(pcap_header), 1, pcap);
+
+	while(Read_Record(dump, &record))
+	{
+		Write_Pcap_Record(pcap, &record);
+
+		frame_us = (uint64_t)record.length * char_bits * 1000000 / baud_rate;
+		if(frames == 0)
+		{
+			first_tick = record.tick;
+			first_frame_us = frame_us;
+		}
+		else	//the ticks are taken at the same delay after every frame end, the gap is the silence before this frame
+		{
+			gaps[Gap_Bucket(((int64_t)record.tick*1000 - (int64_t)frame_us - (int64_t)previous_end_us) / 1000)]++;
+		}
+		previous_end_us = (uint64_t)record.tick*1000;
+		last_tick = record.tick;
+
+		slaves[record.data[0]].frames++;
+		slaves[record.data[0]].bytes += record.length;
+		slaves[record.data[0]].line_us += frame_us;
+		line_us += frame_us;
+		frames++;
+	}
+	fclose(dump);
+	fclose(pcap);
+
+	if(frames == 0)
+	{
+		printf("no frames\n");
+		return 0;
+	}
+
+	uint64_t span_us = (uint64_t)(last_tick - first_tick)*1000 + first_frame_us;	//from the start of the first frame
+	printf("%u frames in %.3f s, %u baud, %u bits per character: bus occupancy %.1f %%\n",
+			frames, span_us / 1e6, baud_rate, char_bits, 100.0 * line_us / span_us);
+	printf("address  frames     bytes   line ms  occupancy\n");
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		if(slaves[i].frames)
+		{
+			printf("%7u %7u %9u %9.1f %9.1f %%\n", i, slaves[i].frames, slaves[i].bytes, slaves[i].line_us / 1e3, 100.0 * slaves[i].line_us / span_us);
+		}
+	}
+	printf("idle gap (ms)   frames\n");
+	for(uint32_t i = 0; i < GAP_BUCKETS; i++)
+	{
+		char label[16];
+
+		if(i == 0)
+		{
+			snprintf(label, sizeof(label), "<1");
+		}
+		else if(i == GAP_BUCKETS - 1)
+		{
+			snprintf(label, sizeof(label), "%u+", 1U << (i-1));
+		}
+		else
+		{
+			snprintf(label, sizeof(label), "%u-%u", 1U << (i-1), 1U << i);
+		}
+		printf("%-13s %8u\n", label, gaps[i]);
+	}
+	return 0;
+}
+
+/*the FC65 request of the drain itself: [address][0x41][CRC]*/
+static int Own_Poll(const uint8_t *record, uint8_t address)
+{
+	return record[4] == 0 && record[5] == 4 && record[6] >= 2 && record[CAPTURE_HEADER_SIZE] == address && record[CAPTURE_HEADER_SIZE+1] == 0x41;
+}
+
+static int Read_Record(FILE *dump, struct record_s *record)
+{
+	uint8_t header[CAPTURE_HEADER_SIZE];
+
+	if(fread(header, sizeof(header), 1, dump) != 1)
+	{
+		return 0;
+	}
+	record->tick = ((uint32_t)header[0]<<24) | ((uint32_t)header[1]<<16) | (header[2]<<8) | header[3];
+	record->length = (header[4]<<8) | header[5];
+	record->stored = header[6];
+	return record->stored > 0 && fread(record->data, record->stored, 1, dump) == 1;
+}
+
+/*the timestamp is the receiver timeout, the frame itself started a frame time and t3.5 earlier*/
+static void Write_Pcap_Record(FILE *pcap, const struct record_s *record)
+{
+	uint32_t header[4] = {record->tick / 1000, (record->tick % 1000) * 1000, record->stored, record->length};
+
+	fwrite(header, sizeof(header), 1, pcap);
+	fwrite(record->data, record->stored, 1, pcap);
+}
+
+/*ticks are milliseconds, so is the resolution of the gaps*/
+static uint32_t Gap_Bucket(int64_t gap_ms)
+{
+	uint32_t bucket = 0;
+
+	while(gap_ms >= 1 && bucket < GAP_BUCKETS - 1)
+	{
+		gap_ms >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void Usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-b baud] [-p parity 0/1/2] [-t seconds] drain <serial device> <slave address> <dump file>\n"
+			"       %s [-b baud] [-c bits per character] convert <dump file> <pcap file>\n", name, name);
+}
@@ -0,0 +1,213 @@
+/*mbr_de_sim.c - bus release after a response for every baud rate code, built with DE_MODE=1 on the virtual line.
+
+  mbr_de_sim [-n registers] [-l ns] > de.csv
+
+  The baud rate code is written with FC06 (register 1) as a master would do, the library reconfigures the USART after
+  the response, then an FC03 request of n registers (default 10) is answered REPEATS times. The line settings and the
+  DE times the library passed to HAL_RS485Ex_Init() are checked and turned into the timeline of the response on the
+  bus. The *_calc_us columns are calculated, not measured: the frame time from the line settings, DE_MODE 1 releases
+  the bus DE_DEASSERTION_TIME sixteenths of a bit after the last stop bit (USART hardware, nothing to run), t3.5 is the
+  receiver timeout the library configured, the silence every master keeps after the response anyway.
+  callback_us is measured on the virtual line (p50 over the repeats): from the end of the transmission to
+  MBR_Switch_DE_Callback(0), the path of the transmission complete callback that releases DE with DE_MODE 0.
+  de_mode0_release_us adds the interrupt entry and HAL_UART_IRQHandler(), which the host cannot run, as a fixed
+  latency (-l, default 5000 ns on a Cortex-M0 at 48 MHz).*/
+#define _GNU_SOURCE
+#include "MODBUS.h"
+#include "mbr_master.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLAVE_ADDRESS		1
+#define BAUD_CODES			7	//uint_hold_reg[1]: 0-6
+#define FC_READ_HOLDING		0x03
+#define FC_WRITE_SINGLE		0x06
+#define REPEATS				101
+
+#define DEV_TYPE	1
+#define DEV_HW		1
+#define DEV_FW		1
+
+const struct structHRVA RegVirtAddr[H_REG_COUNT] =		// 0-RW, 1-RO, 2-NA
+{//		addr	r/w		sgn 	min 	max 	def
+	{0x01,		0,		0,		1,		247,	1,		},	//1		Device slave address
+	{0x02,		0,		0,		0,		6,		2		},	//2		Modbus bound rate
+	{0x03,		0,		0,		0,		2,		1		},	//3		Modbus parity
+	{0x04,		1,		0,		0,		0,		DEV_TYPE},	//4		Device type
+	{0x05,		1,		0,		0,		0,		DEV_HW	},	//5		HW version
+	{0x06,		1,		0,		0,		0,		DEV_FW	},	//6		FW version
+	{0x00,		2,		0,		0,		0,		0		},	//7		NA
+	{0x08,		0,		0,		0,		60,		0		},	//8		Modbus safety timeout
+	{0x09,		0,		0,		0,		1,		0		},	//9		NBT
+	{0x0A,		0,		0,		0,		1,		0		},	//10	Modbus reset
+};
+
+static const uint32_t baud_rates[BAUD_CODES] = {4800, 9600, 19200, 38400, 57600, 115200, 230400};
+
+static UART_HandleTypeDef huart;
+static uint16_t hold_values[H_REG_COUNT];
+static uint8_t flg_values_stored;
+static uint8_t buf_response[256];
+static uint16_t len_response;
+static uint64_t ns_transmit_end;	//the last stop bit on the virtual line
+static uint64_t ns_de_release;	//MBR_Switch_DE_Callback(0)
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static void Transmit(const uint8_t *frame, uint16_t size);
+static uint8_t Read_Register(uint16_t address, uint16_t *data);
+static uint8_t Write_Register(uint16_t address, uint16_t data);
+static uint16_t Request(uint8_t function_code, uint16_t address, uint16_t value);
+static uint64_t Now_Ns(void);
+static int Compare_U64(const void *a, const void *b);
+
+
+int main(int argc, char **argv)
+{
+	uint16_t registers = 10;
+	double isr_latency_ns = 5000;
+	int option;
+
+	while((option = getopt(argc, argv, "n:l:")) != -1)
+	{
+		switch(option)
+		{
+		case 'n':	registers = strtoul(optarg, NULL, 0);	break;
+		case 'l':	isr_latency_ns = strtod(optarg, NULL);	break;
+		default:
+			fprintf(stderr, "usage: %s [-n registers] [-l ns]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(registers == 0 || registers > H_REG_COUNT)
+	{
+		fprintf(stderr, "mbr_de_sim: 1-%u registers\n", H_REG_COUNT);
+		return 2;
+	}
+
+	if(MBR_Port_Open_Virtual(&huart, Transmit))
+	{
+		perror("mbr_de_sim");
+		return 1;
+	}
+	MBR_Init_Modbus(&huart, Read_Register, Write_Register);
+
+	printf("baud,bit_us,char_bits,response_bytes,response_calc_us,de_lead_calc_us,de_mode1_release_calc_us,callback_us,"
+			"de_mode0_release_us,t35_calc_us\n");
+	for(uint16_t code = 0; code < BAUD_CODES; code++)
+	{
+		if(Request(FC_WRITE_SINGLE, 1, code) != 8)	//echo, sent with the previous baud rate
+		{
+			fprintf(stderr, "mbr_de_sim: baud rate code %u not accepted\n", code);
+			return 1;
+		}
+		if(huart.Init.BaudRate != baud_rates[code] || !huart.DEEnabled)
+		{
+			fprintf(stderr, "mbr_de_sim: code %u: USART at %u baud, DE output %s\n", code, huart.Init.BaudRate,
+					huart.DEEnabled ? "on" : "off");
+			return 1;
+		}
+
+		uint64_t callback_ns[REPEATS];
+		uint16_t bytes = 0;
+		for(uint32_t i = 0; i < REPEATS; i++)
+		{
+			ns_de_release = 0;
+			bytes = Request(FC_READ_HOLDING, 0, registers);
+			if(bytes != 5 + 2*registers || ns_de_release < ns_transmit_end)
+			{
+				fprintf(stderr, "mbr_de_sim: code %u: %u byte response, DE %s\n", code, bytes, ns_de_release ? "released" : "not released");
+				return 1;
+			}
+			callback_ns[i] = ns_de_release - ns_transmit_end;
+		}
+		qsort(callback_ns, REPEATS, sizeof(uint64_t), Compare_U64);
+
+		double bit_us = 1e6 / huart.Init.BaudRate;
+		uint32_t char_bits = 1 + 8 + (huart.Init.Parity != UART_PARITY_NONE) + ((huart.Init.StopBits == UART_STOPBITS_2) ? 2 : 1);
+
+		printf("%u,%.3f,%u,%u,%.1f,%.2f,%.2f,%.3f,%.2f,%.1f\n", huart.Init.BaudRate, bit_us, char_bits, bytes,
+				bytes * char_bits * bit_us, huart.DEAssertionTime * bit_us / 16, huart.DEDeassertionTime * bit_us / 16,
+				callback_ns[REPEATS / 2] / 1000.0, (isr_latency_ns + callback_ns[REPEATS / 2]) / 1000, huart.ReceiverTimeout * bit_us);
+	}
+	return 0;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+static void Transmit(const uint8_t *frame, uint16_t size)
+{
+	memcpy(buf_response, frame, size);
+	len_response = size;
+	ns_transmit_end = Now_Ns();	//HAL_UART_TxCpltCallback() follows
+}
+
+/*the DE output of the board: DE_MODE 0 resets its GPIO just before this call*/
+void MBR_Switch_DE_Callback(uint8_t state)
+{
+	if(state == 0)
+	{
+		ns_de_release = Now_Ns();
+	}
+}
+
+static uint8_t Read_Register(uint16_t address, uint16_t *data)
+{
+	if(!flg_values_stored)	//first start: the library writes the default values
+	{
+		return 1;
+	}
+	*data = hold_values[(address < H_REG_COUNT) ? address : 0];	//register number (or MBR_FIRST_START_PROBE)
+	return 0;
+}
+
+static uint8_t Write_Register(uint16_t address, uint16_t data)
+{
+	for(uint16_t i = 0; i < H_REG_COUNT; i++)	//virtual address
+	{
+		if(RegVirtAddr[i].virtualAddress == address && RegVirtAddr[i].RW != 2)
+		{
+			hold_values[i] = data;
+		}
+	}
+	flg_values_stored = 1;
+	return 0;
+}
+
+/*FC03 or FC06 through the whole receive path: the frame ends at the receiver timeout of the port*/
+static uint16_t Request(uint8_t function_code, uint16_t address, uint16_t value)
+{
+	uint8_t request[8] = {SLAVE_ADDRESS, function_code, address>>8, address, value>>8, value};
+	uint16_t crc16 = MBR_Master_CRC16(request, 6);
+
+	request[6] = crc16;
+	request[7] = crc16>>8;
+	len_response = 0;
+	MBR_Port_Inject(&huart, request, sizeof(request));
+	MBR_Port_Poll(&huart, 0);
+	MBR_Check_For_Request();
+
+	if(len_response < 5 || MBR_Master_CRC16(buf_response, len_response) != 0 || buf_response[1] != function_code)
+	{
+		return 0;
+	}
+	return len_response;
+}
+
+static uint64_t Now_Ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int Compare_U64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,446 @@
+/*mbr_enum_sim.c - address assignment of many unaddressed slaves with the UID search (command 105), on simulated RS-485.
+
+  mbr_enum_sim [-n devices] [-c capture %] [-t timeout ms] [-s seed]
+
+  Every device is a child process running MODBUS.c on the virtual line of the port, with a random UID and the default
+  address 1. The parent is the master and the bus: a request goes to every device, the replies of several devices
+  collide as a wired AND of their bytes (padded with the idle level), with the capture probability (-c) one of them
+  overrides the others and the collision looks clean. The master walks the UID tree with command 105, confirms every
+  clean reply with command 101, assigns addresses 2-247 with command 102 and searches the same prefix again.
+  At the end every UID must be found and every assigned address must answer FC03 alone.
+
+  Bus time is counted at 19200 baud 8E1: request, t3.5, response or the master timeout (-t, default 10 ms), t3.5.*/
+#define _GNU_SOURCE
+#include "MODBUS.h"
+#include "mbr_master.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_DEVICES			1000
+#define DEFAULT_ADDRESS		1
+#define FIRST_ADDRESS		2
+#define LAST_ADDRESS		247
+#define UID_BITS			96
+#define BAUD_RATE			19200
+#define CHAR_BITS			11	//8E1
+#define T35_US				(3.5 * CHAR_BITS * 1e6 / BAUD_RATE)
+
+#define DEV_TYPE	1
+#define DEV_HW		1
+#define DEV_FW		1
+
+const struct structHRVA RegVirtAddr[H_REG_COUNT] =		// 0-RW, 1-RO, 2-NA
+{//		addr	r/w		sgn 	min 	max 	def
+	{0x01,		0,		0,		1,		247,	1,		},	//1		Device slave address
+	{0x02,		0,		0,		0,		6,		2		},	//2		Modbus bound rate
+	{0x03,		0,		0,		0,		2,		1		},	//3		Modbus parity
+	{0x04,		1,		0,		0,		0,		DEV_TYPE},	//4		Device type
+	{0x05,		1,		0,		0,		0,		DEV_HW	},	//5		HW version
+	{0x06,		1,		0,		0,		0,		DEV_FW	},	//6		FW version
+	{0x00,		2,		0,		0,		0,		0		},	//7		NA
+	{0x08,		0,		0,		0,		60,		0		},	//8		Modbus safety timeout
+	{0x09,		0,		0,		0,		1,		0		},	//9		NBT
+	{0x0A,		0,		0,		0,		1,		0		},	//10	Modbus reset
+};
+
+struct device_s
+{
+	int fd;	//parent end of the socket pair
+	pid_t pid;
+	uint16_t uid[6];
+	uint8_t found;
+};
+
+struct prefix_s
+{
+	uint8_t bits;
+	uint8_t uid[12];
+};
+
+struct sim_stats_s
+{
+	uint32_t exchanges[3];	//105, 101, 102
+	uint32_t silent;
+	uint32_t collisions;	//corrupted replies
+	uint32_t captures;	//collisions that looked clean
+	uint32_t rejected;	//clean 105 replies not confirmed by 101
+	double bus_us;
+};
+
+static struct device_s devices[MAX_DEVICES];
+static uint32_t cnt_devices = 250;
+static double capture_percent;
+static double timeout_us = 10000;
+static struct sim_stats_s stats;
+static uint8_t flg_count_time;
+
+/*slave side*/
+static UART_HandleTypeDef huart;
+static uint16_t hold_values[H_REG_COUNT];
+static uint8_t flg_values_stored;
+static uint8_t buf_reply[256];
+static uint16_t len_reply;
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static void Run_Device(int fd, const uint16_t *uid);
+static void Transmit(const uint8_t *frame, uint16_t size);
+static uint8_t Read_Register(uint16_t address, uint16_t *data);
+static uint8_t Write_Register(uint16_t address, uint16_t data);
+static uint16_t Bus_Exchange(uint8_t *request, uint16_t len, uint8_t *response);
+static uint32_t Search(void);
+static uint8_t Confirm(const uint8_t *reply, uint8_t address);
+static void Mark_Found(const uint8_t *uid);
+static uint32_t Check_Addresses(uint32_t assigned);
+static void Set_Prefix_Bit(struct prefix_s *prefix, uint8_t bit);
+
+
+int main(int argc, char **argv)
+{
+	long seed = 1;
+	int option, sockets[2];
+
+	while((option = getopt(argc, argv, "n:c:t:s:")) != -1)
+	{
+		switch(option)
+		{
+		case 'n':	cnt_devices = strtoul(optarg, NULL, 0);	break;
+		case 'c':	capture_percent = strtod(optarg, NULL);	break;
+		case 't':	timeout_us = strtod(optarg, NULL) * 1000;	break;
+		case 's':	seed = strtol(optarg, NULL, 0);	break;
+		default:
+			fprintf(stderr, "usage: %s [-n devices] [-c capture %%] [-t timeout ms] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(cnt_devices == 0 || cnt_devices > MAX_DEVICES)
+	{
+		fprintf(stderr, "mbr_enum_sim: 1-%u devices\n", MAX_DEVICES);
+		return 2;
+	}
+
+	srand48(seed);
+	for(uint32_t i = 0; i < cnt_devices; i++)
+	{
+		for(uint32_t j = 0; j < 6; j++)
+		{
+			devices[i].uid[j] = lrand48();
+		}
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets))
+		{
+			perror("mbr_enum_sim");
+			return 1;
+		}
+		devices[i].pid = fork();
+		if(devices[i].pid == 0)
+		{
+			close(sockets[0]);
+			Run_Device(sockets[1], devices[i].uid);
+		}
+		close(sockets[1]);
+		devices[i].fd = sockets[0];
+	}
+
+	flg_count_time = 1;
+	uint32_t assigned = Search();
+	flg_count_time = 0;
+
+	uint32_t found = 0;
+	for(uint32_t i = 0; i < cnt_devices; i++)
+	{
+		found += devices[i].found;
+	}
+	uint32_t answering = Check_Addresses(assigned);
+
+	printf("%u devices, capture probability %.0f %%, seed %ld\n", cnt_devices, capture_percent, seed);
+	printf("found %u, assigned %u (addresses %u-%u), answering alone on their address %u\n",
+			found, assigned, FIRST_ADDRESS, FIRST_ADDRESS + assigned - 1, answering);
+	printf("exchanges: 105 %u, 101 %u, 102 %u, total %u\n", stats.exchanges[0], stats.exchanges[1], stats.exchanges[2],
+			stats.exchanges[0] + stats.exchanges[1] + stats.exchanges[2]);
+	printf("no reply %u, corrupted %u, clean collisions %u, rejected by 101 %u\n", stats.silent, stats.collisions,
+			stats.captures, stats.rejected);
+	printf("bus time %.2f s at %u baud (%.1f ms per device)\n", stats.bus_us / 1e6, BAUD_RATE, stats.bus_us / 1e3 / cnt_devices);
+
+	for(uint32_t i = 0; i < cnt_devices; i++)
+	{
+		kill(devices[i].pid, SIGKILL);
+		waitpid(devices[i].pid, NULL, 0);
+	}
+	return (found == cnt_devices && answering == assigned) ? 0 : 1;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+/*child: one slave, requests come from the socket, the reply goes back with a leading byte (an empty reply is 1 byte)*/
+static void Run_Device(int fd, const uint16_t *uid)
+{
+	uint8_t request[256];
+	ssize_t length;
+
+	if(MBR_Port_Open_Virtual(&huart, Transmit))
+	{
+		_exit(1);
+	}
+	memcpy(port_uid, uid, sizeof(port_uid));	//after the port has read the machine ID
+	MBR_Init_Modbus(&huart, Read_Register, Write_Register);
+
+	while((length = read(fd, request, sizeof(request))) > 0)
+	{
+		len_reply = 0;
+		MBR_Port_Inject(&huart, request, length);
+		MBR_Port_Poll(&huart, 0);
+		MBR_Check_For_Request();
+		memmove(&buf_reply[1], buf_reply, len_reply);
+		buf_reply[0] = 0;
+		write(fd, buf_reply, 1 + len_reply);
+	}
+	_exit(0);
+}
+
+static void Transmit(const uint8_t *frame, uint16_t size)
+{
+	memcpy(buf_reply, frame, size);
+	len_reply = size;
+}
+
+static uint8_t Read_Register(uint16_t address, uint16_t *data)
+{
+	if(!flg_values_stored)	//first start: the library writes the default values
+	{
+		return 1;
+	}
+	*data = hold_values[(address < H_REG_COUNT) ? address : 0];	//register number (or MBR_FIRST_START_PROBE)
+	return 0;
+}
+
+static uint8_t Write_Register(uint16_t address, uint16_t data)
+{
+	for(uint16_t i = 0; i < H_REG_COUNT; i++)	//virtual address
+	{
+		if(RegVirtAddr[i].virtualAddress == address && RegVirtAddr[i].RW != 2)
+		{
+			hold_values[i] = data;
+		}
+	}
+	flg_values_stored = 1;
+	return 0;
+}
+
+/*the CRC is appended to the request, returns the length of what the master receives (CRC not checked), 0 = silence*/
+static uint16_t Bus_Exchange(uint8_t *request, uint16_t len, uint8_t *response)
+{
+	uint8_t reply[257], captured[256];
+	uint16_t crc16 = MBR_Master_CRC16(request, len), longest = 0, len_captured = 0;
+	uint32_t repliers = 0;
+	ssize_t length;
+
+	request[len] = crc16;
+	request[len+1] = crc16>>8;
+	len += 2;
+	for(uint32_t i = 0; i < cnt_devices; i++)
+	{
+		write(devices[i].fd, request, len);
+	}
+
+	memset(response, 0xFF, 256);	//idle line
+	for(uint32_t i = 0; i < cnt_devices; i++)
+	{
+		length = read(devices[i].fd, reply, sizeof(reply)) - 1;
+		if(length <= 0)
+		{
+			continue;
+		}
+		repliers++;
+		if(lrand48() % repliers == 0)	//uniform choice of the device that would override the others
+		{
+			memcpy(captured, &reply[1], length);
+			len_captured = length;
+		}
+		for(ssize_t j = 0; j < length; j++)
+		{
+			response[j] &= reply[1+j];	//a driven 0 wins over the 1 of the other drivers
+		}
+		if(length > longest)
+		{
+			longest = length;
+		}
+	}
+
+	if(flg_count_time)
+	{
+		stats.bus_us += len * CHAR_BITS * 1e6 / BAUD_RATE + T35_US;
+		stats.bus_us += repliers ? longest * CHAR_BITS * 1e6 / BAUD_RATE + T35_US : timeout_us;
+		if(repliers == 0)
+		{
+			stats.silent++;
+		}
+	}
+	if(repliers > 1)
+	{
+		if(drand48() * 100 < capture_percent)
+		{
+			memcpy(response, captured, len_captured);
+			stats.captures++;
+			return len_captured;
+		}
+		if(MBR_Master_CRC16(response, longest) != 0)
+		{
+			stats.collisions++;
+		}
+		else	//identical replies or a lucky wired AND: clean too
+		{
+			stats.captures++;
+		}
+	}
+	return longest;
+}
+
+/*UID tree walk, returns the number of assigned addresses*/
+static uint32_t Search(void)
+{
+	static struct prefix_s stack[2*UID_BITS + 2];
+	uint8_t request[64], response[256];
+	uint32_t depth = 0, assigned = 0;
+	uint16_t length;
+
+	memset(request, 0xAA, 8);
+	request[0] = DEFAULT_ADDRESS;
+	request[1] = 103;	//go to autoassignment mode, no reply
+	Bus_Exchange(request, 6, response);
+
+	stack[depth++] = (struct prefix_s){0};
+	while(depth)
+	{
+		struct prefix_s prefix = stack[--depth];
+
+		request[0] = DEFAULT_ADDRESS;
+		request[1] = 105;
+		request[2] = prefix.bits;
+		memcpy(&request[3], prefix.uid, 12);
+		stats.exchanges[0]++;
+		length = Bus_Exchange(request, 15, response);
+		if(length == 0)	//nobody below this prefix
+		{
+			continue;
+		}
+
+		if(length == 28 && MBR_Master_CRC16(response, 28) == 0 && response[1] == 105)
+		{
+			uint8_t address = (FIRST_ADDRESS + assigned <= LAST_ADDRESS) ? FIRST_ADDRESS + assigned : 0;
+
+			if(Confirm(response, address))
+			{
+				assigned += (address != 0);
+				stack[depth++] = prefix;	//a collision can look clean: the same prefix again
+				continue;
+			}
+			stats.rejected++;
+		}
+		if(prefix.bits < UID_BITS)	//several devices: one more bit
+		{
+			struct prefix_s child = prefix;
+
+			child.bits++;
+			Set_Prefix_Bit(&child, 1);
+			stack[depth++] = child;
+			Set_Prefix_Bit(&child, 0);
+			stack[depth++] = child;
+		}
+	}
+	return assigned;
+}
+
+/*101 with the UID of the clean reply: only that device answers. Then 102 assigns the address (0 = none left).*/
+static uint8_t Confirm(const uint8_t *reply, uint8_t address)
+{
+	uint8_t request[64], response[256];
+	uint16_t length;
+
+	memset(request, 0xAA, sizeof(request));
+	request[0] = DEFAULT_ADDRESS;
+	request[1] = 101;
+	memcpy(&request[7], &reply[2], 24);	//UID, production ID and device type
+	stats.exchanges[1]++;
+	length = Bus_Exchange(request, 31, response);
+	if(length != 28 || MBR_Master_CRC16(response, 28) != 0 || response[1] != 101 || memcmp(&response[2], &reply[2], 24))
+	{
+		return 0;
+	}
+	Mark_Found(&reply[2]);
+
+	if(address == 0)	//confirmed, waits for 102 and no longer answers 105
+	{
+		return 1;
+	}
+	memset(request, 0xAA, sizeof(request));
+	request[0] = DEFAULT_ADDRESS;
+	request[1] = 102;
+	request[8] = address;
+	memcpy(&request[9], &reply[2], 24);
+	stats.exchanges[2]++;
+	length = Bus_Exchange(request, 33, response);
+	return length == 6 && MBR_Master_CRC16(response, 6) == 0 && response[0] == address && response[1] == 102;
+}
+
+static void Mark_Found(const uint8_t *uid)
+{
+	for(uint32_t i = 0; i < cnt_devices; i++)
+	{
+		uint32_t j = 0;
+
+		while(j < 6 && devices[i].uid[j] == ((uid[2*j]<<8) | uid[2*j+1]))
+		{
+			j++;
+		}
+		if(j == 6)
+		{
+			devices[i].found = 1;
+		}
+	}
+}
+
+/*FC03 of the address register on every assigned address: one clean reply with the address itself*/
+static uint32_t Check_Addresses(uint32_t assigned)
+{
+	uint8_t request[8], response[256];
+	uint32_t answering = 0;
+
+	for(uint32_t i = 0; i < assigned; i++)
+	{
+		uint8_t address = FIRST_ADDRESS + i;
+		uint64_t captures = stats.captures;
+
+		request[0] = address;
+		request[1] = 0x03;
+		request[2] = 0;
+		request[3] = 0;
+		request[4] = 0;
+		request[5] = 1;
+		if(Bus_Exchange(request, 6, response) == 7 && stats.captures == captures && MBR_Master_CRC16(response, 7) == 0
+				&& response[0] == address && response[4] == address)
+		{
+			answering++;
+		}
+	}
+	return answering;
+}
+
+/*bit number bits-1 of the prefix, most significant bit of the first UID byte first*/
+static void Set_Prefix_Bit(struct prefix_s *prefix, uint8_t bit)
+{
+	uint8_t position = prefix->bits - 1;
+
+	if(bit)
+	{
+		prefix->uid[position/8] |= 0x80 >> (position%8);
+	}
+	else
+	{
+		prefix->uid[position/8] &= ~(0x80 >> (position%8));
+	}
+}
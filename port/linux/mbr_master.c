@@ -0,0 +1,170 @@
+/*mbr_master.c - minimal RTU master of the host tools: the response ends when the line is silent for t3.5*/
+#define _GNU_SOURCE
+#include "mbr_master.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint32_t master_gap_us = 2005;	//t3.5 of the opened line
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static uint64_t Master_Now(void);
+static speed_t Master_Speed(uint32_t baud_rate);
+
+
+/**
+ * @brief Open the serial device (or pseudo-terminal) in raw mode.
+ * @param device e.g. /dev/ttyUSB0
+ * @param baud_rate 4800-230400
+ * @param parity 0=none, 1=even, 2=odd
+ * @retval the file descriptor, -1 = error (errno is set)
+ */
+int MBR_Master_Open(const char *device, uint32_t baud_rate, uint8_t parity)
+{
+	struct termios tio;
+	speed_t speed = Master_Speed(baud_rate);
+	int fd;
+
+	if(speed == B0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0)
+	{
+		return -1;
+	}
+	if(tcgetattr(fd, &tio) == 0)	//a pseudo-terminal accepts the settings and ignores the baud rate
+	{
+		cfmakeraw(&tio);
+		tio.c_cflag &= ~(PARENB | PARODD | CSTOPB | CRTSCTS);
+		tio.c_cflag |= CLOCAL | CREAD;
+		if(parity)
+		{
+			tio.c_cflag |= PARENB | ((parity == 2) ? PARODD : 0);
+		}
+		tio.c_cc[VMIN] = 0;
+		tio.c_cc[VTIME] = 0;
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	master_gap_us = (baud_rate > 19200) ? 1750 : (uint32_t)(39 * 1000000ULL / baud_rate);	//same silent interval as the slave
+	master_gap_us += 5;
+	return fd;
+}
+
+/**
+ * @brief Send the request and wait for the response.
+ * @param fd from MBR_Master_Open()
+ * @param request the frame without the CRC, the buffer needs two more bytes for it
+ * @param len length of the request without the CRC
+ * @param response buffer for the response (with the CRC)
+ * @param size size of the response buffer
+ * @param timeout_ms longest wait for the first response byte
+ * @retval response length, 0 = no response (broadcast or silent slave), -1 = bad CRC or I/O error
+ */
+int MBR_Master_Transact(int fd, uint8_t *request, uint16_t len, uint8_t *response, uint16_t size, uint32_t timeout_ms)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	uint16_t crc16 = MBR_Master_CRC16(request, len);
+	uint64_t deadline, now;
+	uint16_t received = 0;
+	ssize_t result;
+
+	request[len] = crc16;
+	request[len+1] = crc16>>8;
+	tcflush(fd, TCIFLUSH);	//a late response of the previous request
+	for(uint16_t written = 0; written < len + 2; )
+	{
+		result = write(fd, request + written, len + 2 - written);
+		if(result < 0 && errno != EAGAIN && errno != EINTR)
+		{
+			return -1;
+		}
+		written += (result > 0) ? result : 0;
+	}
+	tcdrain(fd);
+
+	deadline = Master_Now() + (uint64_t)timeout_ms * 1000000;
+	for(;;)
+	{
+		now = Master_Now();
+		if(now >= deadline)
+		{
+			break;
+		}
+		struct timespec wait = {.tv_sec = (deadline - now) / 1000000000, .tv_nsec = (deadline - now) % 1000000000};
+		if(ppoll(&pfd, 1, &wait, NULL) <= 0 || !(pfd.revents & POLLIN))
+		{
+			break;
+		}
+		result = read(fd, response + received, size - received);
+		if(result <= 0)
+		{
+			break;
+		}
+		received += result;
+		deadline = Master_Now() + (uint64_t)master_gap_us * 1000;	//the frame ends with the silent interval
+		if(received == size)
+		{
+			break;
+		}
+	}
+
+	if(received == 0)
+	{
+		return 0;
+	}
+	if(received < 4 || MBR_Master_CRC16(response, received - 2) != (response[received-2] | (response[received-1]<<8)))
+	{
+		return -1;
+	}
+	return received;
+}
+
+uint16_t MBR_Master_CRC16(const uint8_t *buf, uint16_t len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while(len--)
+	{
+		crc ^= *buf++;
+		for(uint32_t i = 0; i < 8; i++)
+		{
+			crc = (crc & 1) ? (crc>>1) ^ 0xA001 : crc>>1;
+		}
+	}
+	return crc;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+static uint64_t Master_Now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static speed_t Master_Speed(uint32_t baud_rate)
+{
+	switch(baud_rate)
+	{
+	case 4800:		return B4800;
+	case 9600:		return B9600;
+	case 19200:		return B19200;
+	case 38400:		return B38400;
+	case 57600:		return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	default:		return B0;
+	}
+}
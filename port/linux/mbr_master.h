@@ -0,0 +1,11 @@
+/*mbr_master.h - minimal RTU master of the host tools: one request, one response, over a serial device or a pseudo-terminal*/
+#ifndef __MBR_MASTER_H
+#define __MBR_MASTER_H
+
+#include <stdint.h>
+
+int MBR_Master_Open(const char *device, uint32_t baud_rate, uint8_t parity);	//parity: 0=none, 1=even, 2=odd (as holding register 2), returns the fd or -1
+int MBR_Master_Transact(int fd, uint8_t *request, uint16_t len, uint8_t *response, uint16_t size, uint32_t timeout_ms);	//appends the CRC, returns the response length (CRC checked), 0 = no response, -1 = bad CRC or error
+uint16_t MBR_Master_CRC16(const uint8_t *buf, uint16_t len);
+
+#endif
@@ -0,0 +1,689 @@
+/*mbr_port.c - Linux backend: a termios serial port plays the USART, its receive DMA channel and the receiver timeout,
+  a thread plays SysTick. MODBUS.c is compiled unchanged against port/linux/main.h.*/
+#define _GNU_SOURCE
+#include "MODBUS.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+
+#if FIRMWARE_TRANSFER
+#error "the Linux port has no bootloader to start a staged image"
+#endif
+
+#define NS_PER_MS					1000000ULL
+#define NS_PER_S					1000000000ULL
+
+/*VARIABLES*/
+USART_TypeDef port_usart1;
+GPIO_TypeDef port_gpioa = {.IDR = USART1_RX_Pin};	//RX line idle, communication reset jumper open
+SysTick_Type port_systick = {.LOAD = NS_PER_MS - 1};	//1 ms of the virtual core
+SCB_Type port_scb;
+uint32_t SystemCoreClock = NS_PER_S;	//cycles of the virtual core are nanoseconds
+uint16_t port_uid[6];
+uint16_t port_pid[5];
+uint32_t port_flash_program_us;
+uint32_t port_flash_erase_us;
+
+static uint64_t ns_port_start;
+static uint8_t flg_port_tick_started;
+static TIM_HandleTypeDef *port_htim;	//the timer started last, one is enough for the library
+static uint8_t flg_port_flash_mapped;
+static uint8_t flg_port_flash_unlocked;
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static uint64_t Port_Now(void);
+static int Port_Start(UART_HandleTypeDef *huart);
+static void *Port_Tick_Thread(void *arg);
+static void Port_Read_Machine_Id(void);
+static speed_t Port_Speed(uint32_t baud_rate);
+static uint64_t Port_Frame_Gap(UART_HandleTypeDef *huart);
+static uint64_t Port_TIM_Deadline(TIM_HandleTypeDef *htim);
+static void Port_Receive(UART_HandleTypeDef *huart);
+static void Port_Frame_End(UART_HandleTypeDef *huart);
+static void Port_Busy_Wait(uint64_t ns);
+
+
+/**
+ * @brief Open the serial device. The line settings are applied later by HAL_UART_Init() from MBR_Init_Modbus().
+ * @param huart handle passed to MBR_Init_Modbus()
+ * @param device e.g. /dev/ttyUSB0, /dev/ttyS1 or the slave side of a pseudo-terminal
+ * @retval 0 = ok, -1 = error (errno is set)
+ */
+int MBR_Port_Open(UART_HandleTypeDef *huart, const char *device)
+{
+	huart->fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(huart->fd < 0)
+	{
+		return -1;
+	}
+	huart->Transmit = NULL;
+
+	if(Port_Start(huart))
+	{
+		close(huart->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Open a virtual line for simulations and benchmarks: no serial device, no baud rate, no line time.
+ *        The line settings are still checked by HAL_UART_Init(). No tick thread is started: the tool calls MBR_Inc_Tick()
+ *        when its simulated time advances (housekeeping jobs, delayed answers), many simulated devices do not load the host.
+ * @param huart handle passed to MBR_Init_Modbus()
+ * @param transmit called with every response instead of writing it to a device
+ * @retval 0 = ok, -1 = error (errno is set)
+ */
+int MBR_Port_Open_Virtual(UART_HandleTypeDef *huart, void (*transmit)(const uint8_t *frame, uint16_t size))
+{
+	huart->fd = -1;
+	huart->Transmit = transmit;
+	return Port_Start(huart);
+}
+
+/**
+ * @brief Receive a whole frame on the virtual line, the line is silent right after it:
+ *        the next MBR_Port_Poll() ends the frame (receiver timeout, or the idle line and the timer with IDLE_LINE_FRAMING).
+ * @param huart handle opened with MBR_Port_Open_Virtual()
+ * @param frame bytes as they come on the bus (with the CRC)
+ * @param size number of bytes
+ * @retval none
+ */
+void MBR_Port_Inject(UART_HandleTypeDef *huart, const uint8_t *frame, uint16_t size)
+{
+	if(!huart->RxActive)	//reception is stopped: the frame is lost as on the bus
+	{
+		return;
+	}
+	for(uint16_t i = 0; i < size; i++)
+	{
+		if(huart->RxPosition == huart->RxXferSize)
+		{
+			huart->RxActive = 0;
+			huart->RxFrameOpen = 0;
+			huart->ErrorCode = HAL_UART_ERROR_ORE;
+			HAL_UART_ErrorCallback(huart);
+			return;
+		}
+		huart->pRxBuffPtr[huart->RxPosition++] = frame[i];
+#if RX_CIRCULAR_DMA
+		if(huart->RxPosition == huart->RxXferSize)
+		{
+			huart->RxPosition = 0;
+		}
+#endif
+	}
+	huart->hdmarx->Instance->CNDTR = huart->RxXferSize - huart->RxPosition;
+	huart->LastRxTime = Port_Now() - Port_Frame_Gap(huart);
+	huart->RxFrameOpen = 1;
+}
+
+/**
+ * @brief Map the flash image file at FLASH_BASE (PORT_FLASH_SIZE bytes), a new or shorter file is extended with erased bytes.
+ *        The image keeps the journal across restarts, a killed process leaves it as a reset leaves the flash.
+ * @param path image file
+ * @retval 0 = ok, -1 = error (errno is set)
+ */
+int MBR_Port_Open_Flash(const char *path)
+{
+	static const uint8_t erased[FLASH_PAGE_SIZE] = {[0 ... FLASH_PAGE_SIZE-1] = 0xFF};
+	struct stat status;
+	void *flash;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if(fd < 0)
+	{
+		return -1;
+	}
+	if(fstat(fd, &status))
+	{
+		close(fd);
+		return -1;
+	}
+	for(off_t size = status.st_size; size < PORT_FLASH_SIZE; )
+	{
+		ssize_t length = FLASH_PAGE_SIZE - size % FLASH_PAGE_SIZE;
+
+		if(pwrite(fd, erased, length, size) != length)
+		{
+			close(fd);
+			return -1;
+		}
+		size += length;
+	}
+
+	flash = mmap((void*)FLASH_BASE, PORT_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	close(fd);
+	if(flash != (void*)FLASH_BASE)
+	{
+		if(flash != MAP_FAILED)
+		{
+			munmap(flash, PORT_FLASH_SIZE);
+			errno = EADDRINUSE;	//kernels before 4.17 take MAP_FIXED_NOREPLACE as a hint
+		}
+		return -1;
+	}
+	flg_port_flash_mapped = 1;
+	return 0;
+}
+
+/**
+ * @brief Wait for serial data, detect the silent line and run the timer. The frame ends when the line stays silent
+ *        for the receiver timeout (HAL_UART_ReceiverTimeout_Config() bits at the current baud rate), as with the USART RTO.
+ *        With IDLE_LINE_FRAMING the idle line interrupt comes after one silent character and the library timer does the rest.
+ * @param huart handle passed to MBR_Init_Modbus()
+ * @param timeout_ms longest wait when no frame is being received
+ * @retval none
+ */
+void MBR_Port_Poll(UART_HandleTypeDef *huart, uint32_t timeout_ms)
+{
+	struct pollfd pfd = {.fd = huart->fd, .events = POLLIN};
+	struct timespec wait;
+	uint64_t now = Port_Now();
+	uint64_t deadline = now + (uint64_t)timeout_ms * NS_PER_MS;
+	int result;
+
+	if(huart->RxFrameOpen && huart->LastRxTime + Port_Frame_Gap(huart) < deadline)
+	{
+		deadline = huart->LastRxTime + Port_Frame_Gap(huart);
+	}
+	if(port_htim != NULL && port_htim->Running && Port_TIM_Deadline(port_htim) < deadline)
+	{
+		deadline = Port_TIM_Deadline(port_htim);
+	}
+	if(!huart->RxActive)	//reception is stopped: the bytes wait in the kernel buffer
+	{
+		pfd.events = 0;
+	}
+
+	wait.tv_sec = (deadline > now) ? (deadline - now) / NS_PER_S : 0;
+	wait.tv_nsec = (deadline > now) ? (deadline - now) % NS_PER_S : 0;
+	result = ppoll(&pfd, 1, &wait, NULL);
+
+	if(result > 0 && (pfd.revents & POLLIN))
+	{
+		Port_Receive(huart);
+		return;
+	}
+	if(result > 0)	//hang up or error, e.g. the other side of a pseudo-terminal is closed: do not spin
+	{
+		nanosleep(&wait, NULL);
+	}
+
+	now = Port_Now();
+	if(huart->RxFrameOpen && now - huart->LastRxTime >= Port_Frame_Gap(huart))
+	{
+		Port_Frame_End(huart);
+	}
+	if(port_htim != NULL && port_htim->Running && now >= Port_TIM_Deadline(port_htim))
+	{
+		port_htim->StartTime = Port_TIM_Deadline(port_htim);	//update event: the counter starts from 0 again
+		HAL_TIM_PeriodElapsedCallback(port_htim);
+	}
+}
+
+
+/*HAL FUNCTIONS*/
+uint32_t HAL_GetTick(void)
+{
+	uint64_t ns = Port_Now() - ns_port_start;
+
+	SysTick->VAL = SysTick->LOAD - (ns % NS_PER_MS);	//SysTick counts down within the millisecond
+	return ns / NS_PER_MS;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	struct timespec wait = {.tv_sec = Delay / 1000, .tv_nsec = (Delay % 1000) * NS_PER_MS};
+
+	nanosleep(&wait, NULL);
+}
+
+void HAL_NVIC_SystemReset(void)
+{
+	exit(EXIT_SUCCESS);
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	struct termios tio;
+	struct serial_struct serial;
+	speed_t speed = Port_Speed(huart->Init.BaudRate);
+
+	if(speed == B0)
+	{
+		return HAL_ERROR;
+	}
+	if(huart->fd < 0)	//virtual line
+	{
+		return HAL_OK;
+	}
+	if(tcgetattr(huart->fd, &tio))
+	{
+		return HAL_ERROR;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+	tio.c_cflag |= CS8 | CLOCAL | CREAD;	//UART_WORDLENGTH_9B is 8 data bits + parity
+	if(huart->Init.Parity != UART_PARITY_NONE)
+	{
+		tio.c_cflag |= PARENB;
+		tio.c_iflag |= INPCK;	//bytes with a parity error are read as 0, the frame fails the CRC check
+	}
+	if(huart->Init.Parity == UART_PARITY_ODD)
+	{
+		tio.c_cflag |= PARODD;
+	}
+	if(huart->Init.StopBits == UART_STOPBITS_2)
+	{
+		tio.c_cflag |= CSTOPB;
+	}
+	tio.c_cc[VMIN] = 0;	//the frame end comes from MBR_Port_Poll(), VTIME is too coarse (0.1 s)
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	if(tcsetattr(huart->fd, TCSANOW, &tio))
+	{
+		return HAL_ERROR;
+	}
+
+	if(ioctl(huart->fd, TIOCGSERIAL, &serial) == 0)	//8250 and USB serial drivers: no receive FIFO threshold / 1 ms USB latency timer
+	{
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(huart->fd, TIOCSSERIAL, &serial);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RS485Ex_Init(UART_HandleTypeDef *huart, uint32_t Polarity, uint32_t AssertionTime, uint32_t DeassertionTime)
+{
+	struct serial_rs485 rs485 = {0};
+
+	if(HAL_UART_Init(huart) != HAL_OK)
+	{
+		return HAL_ERROR;
+	}
+
+	/*the kernel drives RTS as DE, its delays are in ms: the 1/16 bit times round down to 0.
+	  Adapters with automatic direction control do not support the ioctl and do not need it.*/
+	rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+	if(huart->fd >= 0)
+	{
+		ioctl(huart->fd, TIOCSRS485, &rs485);
+	}
+	huart->DEEnabled = 1;
+	huart->DEAssertionTime = AssertionTime;	//kept for the simulations of the virtual line
+	huart->DEDeassertionTime = DeassertionTime;
+	UNUSED(Polarity);
+	return HAL_OK;
+}
+
+void HAL_UART_ReceiverTimeout_Config(UART_HandleTypeDef *huart, uint32_t TimeoutValue)
+{
+	huart->ReceiverTimeout = TimeoutValue;
+	huart->Instance->RTOR = TimeoutValue;
+}
+
+HAL_StatusTypeDef HAL_UART_EnableReceiverTimeout(UART_HandleTypeDef *huart)
+{
+	UNUSED(huart);	//MBR_Port_Poll() always applies the receiver timeout
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+	huart->RxActive = 0;
+	huart->RxFrameOpen = 0;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if(Size == 0)
+	{
+		return HAL_ERROR;
+	}
+
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	huart->RxPosition = 0;
+	huart->RxFrameOpen = 0;
+	huart->hdmarx->Instance->CNDTR = Size;
+	huart->RxActive = 1;
+	return HAL_OK;
+}
+
+/**
+ * @brief Write the frame and wait until the last stop bit has left, then call the transfer complete callback
+ *        (the DE GPIO, the baud rate change and the bootloader jump all expect the bus to be free).
+ */
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	struct pollfd pfd = {.fd = huart->fd, .events = POLLOUT};
+	ssize_t written;
+
+	if(Size == 0)
+	{
+		return HAL_ERROR;
+	}
+	if(huart->fd < 0)	//virtual line
+	{
+		huart->Transmit(pData, Size);
+		HAL_UART_TxCpltCallback(huart);
+		return HAL_OK;
+	}
+
+	while(Size)
+	{
+		written = write(huart->fd, pData, Size);
+		if(written < 0)
+		{
+			if(errno != EAGAIN && errno != EINTR)
+			{
+				return HAL_ERROR;
+			}
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		pData += written;
+		Size -= written;
+	}
+	tcdrain(huart->fd);
+
+	HAL_UART_TxCpltCallback(huart);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	flg_port_flash_unlocked = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	flg_port_flash_unlocked = 0;
+	return HAL_OK;
+}
+
+/**
+ * @brief Program 1, 2 or 4 half-words (STM32F0/F1/F3 rules): a half-word that is not erased can only be
+ *        programmed with 0, anything else is a programming error and stops the operation.
+ */
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	uint32_t half_words = (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 1 : (TypeProgram == FLASH_TYPEPROGRAM_WORD) ? 2 : 4;
+	volatile uint16_t *destination = (volatile uint16_t*)(uintptr_t)Address;
+
+	if(!flg_port_flash_mapped || !flg_port_flash_unlocked || (Address & 1)
+			|| Address < FLASH_BASE || Address + 2*half_words > FLASH_BASE + PORT_FLASH_SIZE)
+	{
+		return HAL_ERROR;
+	}
+	for(uint32_t i = 0; i < half_words; i++, Data >>= 16)
+	{
+		Port_Busy_Wait((uint64_t)port_flash_program_us * 1000);
+		if(destination[i] != 0xFFFF && (uint16_t)Data != 0)
+		{
+			return HAL_ERROR;
+		}
+		destination[i] = Data;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+	uint32_t address = pEraseInit->PageAddress;
+
+	*PageError = 0xFFFFFFFF;
+	if(!flg_port_flash_mapped || !flg_port_flash_unlocked || pEraseInit->TypeErase != FLASH_TYPEERASE_PAGES)
+	{
+		return HAL_ERROR;
+	}
+	for(uint32_t i = 0; i < pEraseInit->NbPages; i++, address += FLASH_PAGE_SIZE)
+	{
+		if((address - FLASH_BASE) % FLASH_PAGE_SIZE || address < FLASH_BASE || address + FLASH_PAGE_SIZE > FLASH_BASE + PORT_FLASH_SIZE)
+		{
+			*PageError = address;
+			return HAL_ERROR;
+		}
+		Port_Busy_Wait((uint64_t)port_flash_erase_us * 1000);
+		memset((void*)(uintptr_t)address, 0xFF, FLASH_PAGE_SIZE);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim)
+{
+	if(htim->Running)
+	{
+		return HAL_ERROR;
+	}
+	htim->StartTime = Port_Now() - (uint64_t)htim->Instance->CNT * 1000;
+	htim->Running = 1;
+	port_htim = htim;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim)
+{
+	htim->Instance->CNT = (Port_Now() - htim->StartTime) / 1000 % (htim->Instance->ARR + 1);
+	htim->Running = 0;
+	return HAL_OK;
+}
+
+__weak void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+	UNUSED(htim);
+}
+
+void Port_TIM_Set_Counter(TIM_HandleTypeDef *htim, uint32_t Counter)
+{
+	htim->Instance->CNT = Counter;
+	htim->StartTime = Port_Now() - (uint64_t)Counter * 1000;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+static uint64_t Port_Now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * NS_PER_S + now.tv_nsec;
+}
+
+/*the part of the USART and DMA state set up at the start, the tick thread is started once per process for a serial device*/
+static int Port_Start(UART_HandleTypeDef *huart)
+{
+	pthread_t thread;
+
+	huart->Instance = USART1;
+	huart->Init.BaudRate = 19200;
+	huart->hdmarx = &huart->hdma_rx;
+	huart->hdma_rx.Instance = &huart->dma_rx_channel;
+	huart->RxActive = 0;
+	huart->RxFrameOpen = 0;
+
+	Port_Read_Machine_Id();
+	prctl(PR_SET_TIMERSLACK, 1UL);	//wake up at the frame end, not up to 50 us later
+
+	if(ns_port_start == 0)
+	{
+		ns_port_start = Port_Now();
+	}
+	if(huart->fd >= 0 && !flg_port_tick_started)	//virtual line: the tool calls MBR_Inc_Tick() in its own time
+	{
+		if(pthread_create(&thread, NULL, Port_Tick_Thread, NULL))
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		pthread_detach(thread);
+		flg_port_tick_started = 1;
+	}
+	return 0;
+}
+
+/*the CPU stalls while the flash is busy, so does the caller: no sleep, other threads keep running*/
+static void Port_Busy_Wait(uint64_t ns)
+{
+	uint64_t end = Port_Now() + ns;
+
+	while(ns && Port_Now() < end);
+}
+
+/*SysTick_Handler: MBR_Inc_Tick() every ms, missed ticks are caught up after a scheduling delay*/
+static void *Port_Tick_Thread(void *arg)
+{
+	struct timespec next;
+
+	UNUSED(arg);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(;;)
+	{
+		next.tv_nsec += NS_PER_MS;
+		if(next.tv_nsec >= (long)NS_PER_S)
+		{
+			next.tv_nsec -= NS_PER_S;
+			next.tv_sec++;
+		}
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);	//a signal must not shorten the tick
+		MBR_Inc_Tick();
+	}
+	return NULL;
+}
+
+/*the first 96 bits of the machine ID are the UID of the slave (FC100-105 autoassignment, special registers 999-1004)*/
+static void Port_Read_Machine_Id(void)
+{
+	uint8_t *uid = (uint8_t*)port_uid;
+	unsigned int byte;
+	FILE *file = fopen("/etc/machine-id", "r");
+
+	if(file == NULL)
+	{
+		return;
+	}
+	for(uint32_t i = 0; i < sizeof(port_uid); i++)
+	{
+		if(fscanf(file, "%2x", &byte) != 1)
+		{
+			break;
+		}
+		uid[i] = byte;
+	}
+	fclose(file);
+}
+
+static speed_t Port_Speed(uint32_t baud_rate)
+{
+	switch(baud_rate)
+	{
+	case 4800:		return B4800;
+	case 9600:		return B9600;
+	case 19200:		return B19200;
+	case 38400:		return B38400;
+	case 57600:		return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	default:		return B0;
+	}
+}
+
+/*silent time that ends the frame: the receiver timeout, or one character for the idle line flag*/
+static uint64_t Port_Frame_Gap(UART_HandleTypeDef *huart)
+{
+#if IDLE_LINE_FRAMING
+	uint32_t bits = (huart->Init.Parity == UART_PARITY_NONE) ? 10 : 11;
+
+	if(huart->Init.StopBits == UART_STOPBITS_2)
+	{
+		bits++;
+	}
+#else
+	uint32_t bits = huart->ReceiverTimeout;
+#endif
+
+	return (uint64_t)bits * NS_PER_S / huart->Init.BaudRate;
+}
+
+/*the update event comes when the counter passes ARR*/
+static uint64_t Port_TIM_Deadline(TIM_HandleTypeDef *htim)
+{
+	return htim->StartTime + ((uint64_t)htim->Instance->ARR + 1) * 1000;
+}
+
+/*DMA: copy the received bytes into the buffer given to HAL_UART_Receive_DMA() and count CNDTR down*/
+static void Port_Receive(UART_HandleTypeDef *huart)
+{
+	ssize_t received;
+
+	if(huart->RxPosition == huart->RxXferSize)	//normal mode buffer is full: the next byte is an overrun
+	{
+		huart->RxActive = 0;
+		huart->RxFrameOpen = 0;
+		huart->ErrorCode = HAL_UART_ERROR_ORE;
+		HAL_UART_ErrorCallback(huart);
+		return;
+	}
+
+	received = read(huart->fd, huart->pRxBuffPtr + huart->RxPosition, huart->RxXferSize - huart->RxPosition);
+	if(received <= 0)
+	{
+		return;
+	}
+
+	huart->RxPosition += received;
+#if RX_CIRCULAR_DMA
+	if(huart->RxPosition == huart->RxXferSize)
+	{
+		huart->RxPosition = 0;
+	}
+#endif
+	huart->hdmarx->Instance->CNDTR = huart->RxXferSize - huart->RxPosition;
+	huart->LastRxTime = Port_Now();
+	huart->RxFrameOpen = 1;
+}
+
+/*receiver timeout or idle line interrupt*/
+static void Port_Frame_End(UART_HandleTypeDef *huart)
+{
+	huart->RxFrameOpen = 0;
+#if IDLE_LINE_FRAMING
+	if(huart->Instance->IER & UART_IT_IDLE)
+	{
+		huart->Instance->ISR |= UART_FLAG_IDLE;
+		MBR_UART_IRQ_Handler();
+	}
+#elif RX_CIRCULAR_DMA
+	huart->Instance->ISR |= UART_FLAG_RTOF;
+	MBR_UART_IRQ_Handler();
+#else
+	huart->RxActive = 0;	//HAL stops the DMA on the receiver timeout error
+	huart->ErrorCode = HAL_UART_ERROR_RTO;
+	HAL_UART_ErrorCallback(huart);
+#endif
+}
@@ -0,0 +1,701 @@
+/*mbr_replay.c - replay captured or synthetic bus traffic against the library at 1x, 10x or maximum speed, built with
+  PERSISTENT_JOURNAL=1 and the register map of mbr_bench.
+
+  mbr_replay [-x speed] [-a address] [-t ms] [-r us] [-u us] [-P us] [-E us] [-f flash image] dump <dump file>
+  mbr_replay [-x speed] [-a address] [-n frames] [-t ms] [-r us] [-u us] [-P us] [-E us] [-f flash image] mix poll|storm|baud
+
+  The slave runs in a thread on the slave side of a pseudo-terminal with the tick thread of the port, the tool is the
+  master on the other side. Frame n is sent at its timestamp divided by the speed (-x 1, 10, 0 = as soon as the line is
+  free), never before the previous response and the silent interval after it. The dump is the FC65 records written by
+  mbr_capture drain, -a is the address of the captured slave (default 1, the slave is moved there before the replay):
+  its own responses are not in the capture, the frames of the other slaves are replayed as bus traffic. The mixes send
+  a frame every 10 ms (storm) or 20 ms:
+    poll	FC03/FC04 polls of 10 registers, every fourth poll is for another slave
+    storm	FC16 of 100 registers between FC03 polls, every write goes through the journal
+    baud	poll, halfway through the master moves the slave to 115200 baud with FC06 (register 1)
+  Every response is checked: CRC, address, function code or exception, the FC03/FC04 byte count, the FC03 values
+  against what the master has written, the FC06/FC16 echo. The turnaround is from the end of the request to the first
+  response byte, the t3.5 frame end detection of the slave included. -r and -u busy wait in
+  MBR_Check_Restrictions_Callback() and MBR_Register_Update_Callback(), -P and -E are the half-word program and page erase
+  times of the flash (default 53 us and 20 ms, STM32F0). A pseudo-terminal does not pace the bytes at the baud rate:
+  the line time is not in the turnaround, the processing of the library and the scheduling of the host are.*/
+#define _GNU_SOURCE
+#include "MODBUS.h"
+#include "mbr_bench.h"
+#include "mbr_master.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_MS			1000000ULL
+#define FRAME_MARGIN_NS		500000ULL	//the slave thread sees the frame end a little after the last byte
+#define CAPTURE_HEADER_SIZE	7
+#define BAUD_CODES			7	//uint_hold_reg[1]: 0-6
+#define OTHER_SLAVE			2	//address of the polls that are not for the slave
+#define FC_READ_HOLDING		0x03
+#define FC_READ_INPUT		0x04
+#define FC_WRITE_SINGLE		0x06
+#define FC_WRITE_MULTIPLE	0x10
+
+struct replay_frame_s
+{
+	uint64_t time_ns;	//from the first frame
+	uint16_t length;
+	uint8_t data[256];
+};
+
+struct fc_stats_s
+{
+	uint32_t requests;
+	uint32_t responses;
+	uint32_t dropped;	//no response within the timeout
+	uint32_t bad;	//CRC, address, length, echo or value
+	uint32_t exceptions[5];	//codes 01-04, [0] = others
+	uint32_t *turnaround_ns;	//responses with or without exception
+};
+
+static const uint32_t baud_rates[BAUD_CODES] = {4800, 9600, 19200, 38400, 57600, 115200, 230400};
+
+static UART_HandleTypeDef huart;
+static struct replay_frame_s *frames;
+static uint32_t cnt_frames;
+static struct fc_stats_s fc_stats[256];
+static uint32_t *all_turnaround_ns;
+static uint32_t cnt_all_turnaround;
+static uint32_t cnt_unexpected;	//bytes on the line when no response was expected
+static uint32_t cnt_truncated;	//dump records the slave stored only in part
+static uint16_t shadow[H_REG_COUNT];	//holding registers as the master knows them
+static uint8_t shadow_known[H_REG_COUNT];
+static uint8_t slave_address = 1;
+static uint8_t baud_code = 2;
+static uint32_t restriction_delay_us;
+static uint32_t update_delay_us;
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static void *Slave_Thread(void *arg);
+static uint8_t Slow_Restriction(uint16_t register_address, uint16_t register_data);
+static void Slow_Update(uint16_t register_address, uint16_t register_data);
+static int Open_Slave(const char *flash_name);
+static int Open_Master(void);
+static int Load_Dump(const char *name);
+static int Build_Mix(const char *name, uint32_t count);
+static void Add_Frame(uint64_t time_ns, uint8_t *frame, uint16_t len);
+static int Move_Slave(int fd);
+static int Read_Shadow(int fd);
+static void Replay(int fd, uint32_t speed, uint32_t timeout_ms);
+static uint16_t Receive_Response(int fd, uint8_t *response, uint64_t sent, uint32_t timeout_ms, uint64_t *first_byte);
+static int Check_Response(const uint8_t *request, uint16_t request_len, const uint8_t *response, uint16_t len);
+static void Apply_Write(const uint8_t *request, uint8_t confirmed);
+static void Report(const char *source, uint32_t speed, uint64_t run_ns);
+static void Print_Line(const char *label, const struct fc_stats_s *stats, uint32_t *turnaround_ns, uint32_t count);
+static uint64_t Frame_Gap_Ns(void);
+static void Put_Word(uint8_t *dst, uint16_t value);
+static void Busy_Wait_Us(uint32_t us);
+static void Sleep_Until(uint64_t ns);
+static uint64_t Replay_Now(void);
+static int Compare_U32(const void *a, const void *b);
+static void Usage(const char *name);
+
+
+int main(int argc, char **argv)
+{
+	const char *flash_name = NULL;
+	uint32_t speed = 1, count = 1000, timeout_ms = 100;
+	uint64_t start;
+	int option, fd;
+
+	port_flash_program_us = 53;
+	port_flash_erase_us = 20000;
+	while((option = getopt(argc, argv, "x:a:n:t:r:u:P:E:f:")) != -1)
+	{
+		switch(option)
+		{
+		case 'x':	speed = strtoul(optarg, NULL, 0);	break;
+		case 'a':	slave_address = strtoul(optarg, NULL, 0);	break;
+		case 'n':	count = strtoul(optarg, NULL, 0);	break;
+		case 't':	timeout_ms = strtoul(optarg, NULL, 0);	break;
+		case 'r':	restriction_delay_us = strtoul(optarg, NULL, 0);	break;
+		case 'u':	update_delay_us = strtoul(optarg, NULL, 0);	break;
+		case 'P':	port_flash_program_us = strtoul(optarg, NULL, 0);	break;
+		case 'E':	port_flash_erase_us = strtoul(optarg, NULL, 0);	break;
+		case 'f':	flash_name = optarg;	break;
+		default:	Usage(argv[0]);	return 2;
+		}
+	}
+	if(optind + 2 != argc || slave_address < 1 || slave_address > 247 || count == 0)
+	{
+		Usage(argv[0]);
+		return 2;
+	}
+
+	if(strcmp(argv[optind], "dump") == 0 ? Load_Dump(argv[optind+1]) :
+			strcmp(argv[optind], "mix") == 0 ? Build_Mix(argv[optind+1], count) : -1)
+	{
+		Usage(argv[0]);
+		return 2;
+	}
+	if(cnt_frames == 0)
+	{
+		fprintf(stderr, "mbr_replay: no frames\n");
+		return 1;
+	}
+	all_turnaround_ns = calloc(cnt_frames, sizeof(uint32_t));
+
+	fd = Open_Master();
+	if(fd < 0 || Open_Slave(flash_name))
+	{
+		perror("mbr_replay");
+		return 1;
+	}
+	if(Move_Slave(fd) || Read_Shadow(fd))
+	{
+		fprintf(stderr, "mbr_replay: the slave does not answer at address %u\n", slave_address);
+		return 1;
+	}
+	bench_restriction = restriction_delay_us ? Slow_Restriction : NULL;
+	bench_update = update_delay_us ? Slow_Update : NULL;
+
+	start = Replay_Now();
+	Replay(fd, speed, timeout_ms);
+	Report(argv[optind+1], speed, Replay_Now() - start);
+	return 0;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+/*the main loop of the device*/
+static void *Slave_Thread(void *arg)
+{
+	UNUSED(arg);
+	for(;;)
+	{
+		MBR_Port_Poll(&huart, 10);
+		MBR_Check_For_Request();
+	}
+	return NULL;
+}
+
+/*a slow application: the CPU is busy, so is the slave*/
+static uint8_t Slow_Restriction(uint16_t register_address, uint16_t register_data)
+{
+	UNUSED(register_address);
+	UNUSED(register_data);
+	Busy_Wait_Us(restriction_delay_us);
+	return 0;
+}
+
+static void Slow_Update(uint16_t register_address, uint16_t register_data)
+{
+	UNUSED(register_address);
+	UNUSED(register_data);
+	Busy_Wait_Us(update_delay_us);
+}
+
+/*the flash image is a deleted temporary file unless -f keeps it*/
+static int Open_Slave(const char *flash_name)
+{
+	char temporary[] = "/tmp/mbr_replay.XXXXXX";
+	pthread_t thread;
+	int fd;
+
+	if(flash_name == NULL)
+	{
+		fd = mkstemp(temporary);
+		if(fd < 0)
+		{
+			return -1;
+		}
+		close(fd);
+		flash_name = temporary;
+	}
+	if(MBR_Port_Open_Flash(flash_name))
+	{
+		return -1;
+	}
+	if(flash_name == temporary)
+	{
+		unlink(temporary);
+	}
+
+	if(MBR_Port_Open(&huart, ptsname(Open_Master())))
+	{
+		return -1;
+	}
+	MBR_Init_Modbus(&huart, MBR_Journal_Read, MBR_Journal_Write);
+	baud_code = uint_hold_reg[1];	//the image can keep an address and a baud rate of a previous run
+	if(pthread_create(&thread, NULL, Slave_Thread, NULL))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/*the master side of the pseudo-terminal, opened once*/
+static int Open_Master(void)
+{
+	static int fd = -1;
+	struct termios tio;
+
+	if(fd >= 0)
+	{
+		return fd;
+	}
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0 || grantpt(fd) || unlockpt(fd))
+	{
+		return -1;
+	}
+	if(tcgetattr(fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	return fd;
+}
+
+/*FC65 records: [tick 4 bytes][frame length 2 bytes][stored length 1 byte][bytes], big-endian*/
+static int Load_Dump(const char *name)
+{
+	uint8_t header[CAPTURE_HEADER_SIZE], data[255];
+	uint32_t tick, first_tick = 0;
+	FILE *dump = fopen(name, "rb");
+
+	if(dump == NULL)
+	{
+		perror(name);
+		return -1;
+	}
+	while(fread(header, sizeof(header), 1, dump) == 1)
+	{
+		uint16_t length = (header[4]<<8) | header[5];
+
+		if(header[6] == 0 || fread(data, header[6], 1, dump) != 1)
+		{
+			break;
+		}
+		if(header[6] != length || length < 4)
+		{
+			cnt_truncated++;
+			continue;
+		}
+		tick = ((uint32_t)header[0]<<24) | ((uint32_t)header[1]<<16) | (header[2]<<8) | header[3];
+		if(cnt_frames == 0)
+		{
+			first_tick = tick;
+		}
+		Add_Frame((uint64_t)(tick - first_tick) * NS_PER_MS, data, length - 2);	//the CRC is computed again
+	}
+	fclose(dump);
+	return 0;
+}
+
+static int Build_Mix(const char *name, uint32_t count)
+{
+	uint8_t frame[256];
+	uint64_t period_ns = 20 * NS_PER_MS;
+	uint8_t storm = strcmp(name, "storm") == 0;
+	uint8_t baud = strcmp(name, "baud") == 0;
+
+	if(!storm && !baud && strcmp(name, "poll") != 0)
+	{
+		return -1;
+	}
+	if(storm)
+	{
+		period_ns = 10 * NS_PER_MS;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint16_t len = 6;
+
+		frame[0] = slave_address;
+		frame[1] = FC_READ_HOLDING;
+		Put_Word(&frame[2], BENCH_UNSIGNED_START);
+		Put_Word(&frame[4], 10);
+		if(baud && i == count / 2)
+		{
+			frame[1] = FC_WRITE_SINGLE;
+			Put_Word(&frame[2], 1);
+			Put_Word(&frame[4], 5);	//115200
+		}
+		else if(storm && (i & 1) == 0)
+		{
+			frame[1] = FC_WRITE_MULTIPLE;
+			Put_Word(&frame[4], 100);
+			frame[6] = 200;
+			for(uint16_t j = 0; j < 100; j++)
+			{
+				Put_Word(&frame[7 + 2*j], (i * 7 + j) % 60001);
+			}
+			len = 7 + 200;
+		}
+		else if(!storm)
+		{
+			switch(i % 4)
+			{
+			case 1:	frame[1] = FC_READ_INPUT;	Put_Word(&frame[2], 0);	break;
+			case 2:	frame[0] = OTHER_SLAVE;	break;
+			case 3:	Put_Word(&frame[2], BENCH_SIGNED_START);	break;
+			default:	break;
+			}
+		}
+		Add_Frame(i * period_ns, frame, len);
+	}
+	return 0;
+}
+
+static void Add_Frame(uint64_t time_ns, uint8_t *frame, uint16_t len)
+{
+	static uint32_t capacity;
+	uint16_t crc16 = MBR_Master_CRC16(frame, len);
+
+	if(cnt_frames == capacity)
+	{
+		capacity = capacity ? 2 * capacity : 1024;
+		frames = realloc(frames, capacity * sizeof(struct replay_frame_s));
+	}
+	frames[cnt_frames].time_ns = time_ns;
+	memcpy(frames[cnt_frames].data, frame, len);
+	frames[cnt_frames].data[len] = crc16;
+	frames[cnt_frames].data[len+1] = crc16>>8;
+	frames[cnt_frames].length = len + 2;
+	cnt_frames++;
+}
+
+/*the slave answers at -a, the image of a previous run can have another address*/
+static int Move_Slave(int fd)
+{
+	uint8_t request[8] = {uint_hold_reg[0], FC_WRITE_SINGLE, 0, 0, 0, slave_address}, response[16];
+
+	if(uint_hold_reg[0] == slave_address)
+	{
+		return 0;
+	}
+	if(MBR_Master_Transact(fd, request, 6, response, sizeof(response), 1000) <= 0)
+	{
+		return -1;
+	}
+	usleep(Frame_Gap_Ns() / 1000 + 1000);
+	return 0;
+}
+
+/*the holding registers before the replay, not timed*/
+static int Read_Shadow(int fd)
+{
+	uint8_t request[8], response[256];
+
+	for(uint16_t first = 0; first < H_REG_COUNT; first += 100)
+	{
+		uint16_t count = (H_REG_COUNT - first < 100) ? H_REG_COUNT - first : 100;
+
+		request[0] = slave_address;
+		request[1] = FC_READ_HOLDING;
+		Put_Word(&request[2], first);
+		Put_Word(&request[4], count);
+		if(MBR_Master_Transact(fd, request, 6, response, sizeof(response), 1000) != 5 + 2*count)
+		{
+			return -1;
+		}
+		for(uint16_t i = 0; i < count; i++)
+		{
+			shadow[first + i] = (response[3 + 2*i]<<8) | response[4 + 2*i];
+			shadow_known[first + i] = 1;
+		}
+		usleep(Frame_Gap_Ns() / 1000 + 1000);
+	}
+	return 0;
+}
+
+static void Replay(int fd, uint32_t speed, uint32_t timeout_ms)
+{
+	uint8_t response[256], drain[256];
+	uint64_t start = Replay_Now(), line_free = start, sent, first_byte = 0, due;
+	ssize_t result;
+
+	for(uint32_t n = 0; n < cnt_frames; n++)
+	{
+		struct replay_frame_s *frame = &frames[n];
+		uint8_t expected = frame->data[0] == slave_address;
+		struct fc_stats_s *stats = &fc_stats[frame->data[1]];
+		uint16_t len;
+
+		due = speed ? start + frame->time_ns / speed : 0;
+		Sleep_Until((due > line_free) ? due : line_free);
+
+		while((result = read(fd, drain, sizeof(drain))) > 0)	//a response to a frame that expected none
+		{
+			cnt_unexpected++;
+		}
+		for(uint16_t written = 0; written < frame->length; )
+		{
+			result = write(fd, frame->data + written, frame->length - written);
+			written += (result > 0) ? result : 0;
+		}
+		sent = Replay_Now();
+
+		if(!expected)	//broadcast or another slave: the frame ends at the silent interval
+		{
+			line_free = sent + Frame_Gap_Ns() + FRAME_MARGIN_NS;
+			if(frame->data[0] == 0)
+			{
+				Apply_Write(frame->data, 0);
+			}
+			continue;
+		}
+
+		stats->requests++;
+		len = Receive_Response(fd, response, sent, timeout_ms, &first_byte);
+		line_free = Replay_Now() + FRAME_MARGIN_NS;
+		if(len == 0)
+		{
+			stats->dropped++;
+			continue;
+		}
+
+		if(stats->turnaround_ns == NULL)
+		{
+			stats->turnaround_ns = calloc(cnt_frames, sizeof(uint32_t));
+		}
+		stats->responses++;
+		stats->turnaround_ns[stats->responses - 1] = first_byte - sent;
+		all_turnaround_ns[cnt_all_turnaround++] = first_byte - sent;
+		switch(Check_Response(frame->data, frame->length, response, len))
+		{
+		case -1:	stats->bad++;	break;
+		case 0:		Apply_Write(frame->data, 1);	break;
+		default:	stats->exceptions[(response[2] >= 1 && response[2] <= 4) ? response[2] : 0]++;	break;
+		}
+	}
+}
+
+/*the response ends when the line is silent for t3.5 at the baud rate the slave had when it answered*/
+static uint16_t Receive_Response(int fd, uint8_t *response, uint64_t sent, uint32_t timeout_ms, uint64_t *first_byte)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	uint64_t deadline = sent + (uint64_t)timeout_ms * NS_PER_MS, now;
+	uint16_t received = 0;
+	ssize_t result;
+
+	for(;;)
+	{
+		now = Replay_Now();
+		if(now >= deadline)
+		{
+			break;
+		}
+		struct timespec wait = {.tv_sec = (deadline - now) / 1000000000, .tv_nsec = (deadline - now) % 1000000000};
+		if(ppoll(&pfd, 1, &wait, NULL) <= 0 || !(pfd.revents & POLLIN))
+		{
+			break;
+		}
+		if(received == 0)
+		{
+			*first_byte = Replay_Now();
+		}
+		result = read(fd, response + received, 256 - received);
+		if(result <= 0)
+		{
+			break;
+		}
+		received += result;
+		deadline = Replay_Now() + Frame_Gap_Ns();
+		if(received == 256)
+		{
+			break;
+		}
+	}
+	return received;
+}
+
+/*0 = response ok, 1 = exception, -1 = bad response*/
+static int Check_Response(const uint8_t *request, uint16_t request_len, const uint8_t *response, uint16_t len)
+{
+	uint8_t function_code = request[1];
+	uint16_t first = (request[2]<<8) | request[3];
+	uint16_t count = (request[4]<<8) | request[5];
+
+	if(len < 4 || MBR_Master_CRC16(response, len) != 0 || response[0] != request[0])
+	{
+		return -1;
+	}
+	if(response[1] == (function_code | 0x80))
+	{
+		return (len == 5) ? 1 : -1;
+	}
+	if(response[1] != function_code)
+	{
+		return -1;
+	}
+
+	switch(function_code)
+	{
+	case FC_READ_HOLDING:
+		if(len != 5 + response[2] || response[2] != 2*count)
+		{
+			return -1;
+		}
+		for(uint16_t i = 0; i < count && first + i < H_REG_COUNT; i++)	//special registers above the map are not checked
+		{
+			if(shadow_known[first + i] && shadow[first + i] != ((response[3 + 2*i]<<8) | response[4 + 2*i]))
+			{
+				return -1;
+			}
+		}
+		return 0;
+	case FC_READ_INPUT:
+		return (len == 5 + response[2] && response[2] == 2*count) ? 0 : -1;
+	case FC_WRITE_SINGLE:
+		return (len == request_len && memcmp(response, request, len) == 0) ? 0 : -1;
+	case FC_WRITE_MULTIPLE:
+		return (len == 8 && memcmp(response, request, 6) == 0) ? 0 : -1;
+	default:
+		return 0;
+	}
+}
+
+/*a confirmed write changes the shadow, a broadcast one may have been refused: the value is no longer known*/
+static void Apply_Write(const uint8_t *request, uint8_t confirmed)
+{
+	uint16_t first = (request[2]<<8) | request[3];
+	uint16_t count = 1;
+	const uint8_t *values = &request[4];
+
+	if(request[1] == FC_WRITE_MULTIPLE)
+	{
+		count = (request[4]<<8) | request[5];
+		values = &request[7];
+	}
+	else if(request[1] != FC_WRITE_SINGLE)
+	{
+		return;
+	}
+
+	for(uint16_t i = 0; i < count && first + i < H_REG_COUNT; i++)
+	{
+		shadow[first + i] = (values[2*i]<<8) | values[2*i + 1];
+		shadow_known[first + i] = confirmed;
+		if(confirmed && first + i == 0)
+		{
+			slave_address = shadow[0];
+		}
+		if(confirmed && first + i == 1 && shadow[1] < BAUD_CODES)
+		{
+			baud_code = shadow[1];
+		}
+	}
+}
+
+static void Report(const char *source, uint32_t speed, uint64_t run_ns)
+{
+	struct fc_stats_s all = {0};
+	char speed_label[16];
+
+	snprintf(speed_label, sizeof(speed_label), "%ux", speed);
+
+	printf("%s, %u frames, speed %s, %.2f s, restriction delay %u us, update delay %u us, flash program %u us, erase %u us\n",
+			source, cnt_frames, speed ? speed_label : "max", run_ns / 1e9, restriction_delay_us, update_delay_us,
+			port_flash_program_us, port_flash_erase_us);
+	printf("fc    requests responses dropped bad  ex01  ex02  ex03  ex04  other  p50_us  p99_us  p99.9_us  max_us\n");
+	for(uint32_t fc = 0; fc < 256; fc++)
+	{
+		struct fc_stats_s *stats = &fc_stats[fc];
+		char label[8];
+
+		if(stats->requests == 0)
+		{
+			continue;
+		}
+		snprintf(label, sizeof(label), "%02X", fc);
+		Print_Line(label, stats, stats->turnaround_ns, stats->responses);
+		all.requests += stats->requests;
+		all.responses += stats->responses;
+		all.dropped += stats->dropped;
+		all.bad += stats->bad;
+		for(uint32_t i = 0; i < 5; i++)
+		{
+			all.exceptions[i] += stats->exceptions[i];
+		}
+	}
+	Print_Line("all", &all, all_turnaround_ns, cnt_all_turnaround);
+	printf("unexpected responses %u, truncated records skipped %u\n", cnt_unexpected, cnt_truncated);
+}
+
+static void Print_Line(const char *label, const struct fc_stats_s *stats, uint32_t *turnaround_ns, uint32_t count)
+{
+	double p50 = 0, p99 = 0, p999 = 0, maximum = 0;
+
+	if(count)
+	{
+		qsort(turnaround_ns, count, sizeof(uint32_t), Compare_U32);
+		p50 = turnaround_ns[count / 2] / 1e3;
+		p99 = turnaround_ns[(uint32_t)(count * 0.99)] / 1e3;
+		p999 = turnaround_ns[(uint32_t)(count * 0.999)] / 1e3;
+		maximum = turnaround_ns[count - 1] / 1e3;
+	}
+	printf("%-5s %8u %9u %7u %4u %5u %5u %5u %5u %6u %7.0f %7.0f %9.0f %7.0f\n", label, stats->requests, stats->responses,
+			stats->dropped, stats->bad, stats->exceptions[1], stats->exceptions[2], stats->exceptions[3], stats->exceptions[4],
+			stats->exceptions[0], p50, p99, p999, maximum);
+}
+
+/*receiver timeout of the slave: 39 bits up to 19200 baud, 1.75 ms above*/
+static uint64_t Frame_Gap_Ns(void)
+{
+	uint32_t baud_rate = baud_rates[baud_code];
+
+	return (baud_rate > 19200) ? 1750000 : 39 * 1000000000ULL / baud_rate;
+}
+
+static void Put_Word(uint8_t *dst, uint16_t value)
+{
+	dst[0] = value>>8;
+	dst[1] = value;
+}
+
+static void Busy_Wait_Us(uint32_t us)
+{
+	uint64_t end = Replay_Now() + (uint64_t)us * 1000;
+
+	while(Replay_Now() < end);
+}
+
+static void Sleep_Until(uint64_t ns)
+{
+	struct timespec until = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+
+	if(ns > Replay_Now())
+	{
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+	}
+}
+
+static uint64_t Replay_Now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int Compare_U32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+static void Usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-x speed] [-a address] [-t ms] [-r us] [-u us] [-P us] [-E us] [-f flash image] dump <dump file>\n"
+			"       %s [-x speed] [-a address] [-n frames] [-t ms] [-r us] [-u us] [-P us] [-E us] [-f flash image] mix poll|storm|baud\n",
+			name, name);
+}
@@ -0,0 +1,149 @@
+/*mbr_slave.c - example RTU slave for the Linux port: mbr_slave <serial device> <register file>
+  The holding registers are kept in the register file, with PERSISTENT_JOURNAL=1 in the journal of the flash image file.
+  SIGUSR1 prints the traffic statistics (TRAFFIC_STATISTICS=1).*/
+#include "MODBUS.h"
+
+#include <signal.h>
+#include <stdio.h>
+
+#define DEV_TYPE	1
+#define DEV_HW		1
+#define DEV_FW		1
+
+const struct structHRVA RegVirtAddr[H_REG_COUNT] =		// 0-RW, 1-RO, 2-NA
+{//		addr	r/w		sgn 	min 	max 	def
+	{0x01,		0,		0,		1,		247,	1,		},	//1		Device slave address
+	{0x02,		0,		0,		0,		6,		2		},	//2		Modbus bound rate
+	{0x03,		0,		0,		0,		2,		1		},	//3		Modbus parity
+	{0x04,		1,		0,		0,		0,		DEV_TYPE},	//4		Device type
+	{0x05,		1,		0,		0,		0,		DEV_HW	},	//5		HW version
+	{0x06,		1,		0,		0,		0,		DEV_FW	},	//6		FW version
+	{0x00,		2,		0,		0,		0,		0		},	//7		NA
+	{0x08,		0,		0,		0,		60,		0		},	//8		Modbus safety timeout
+	{0x09,		0,		0,		0,		1,		0		},	//9		NBT
+	{0x0A,		0,		0,		0,		1,		0		},	//10	Modbus reset
+};
+
+static UART_HandleTypeDef huart;
+static volatile sig_atomic_t flg_print_stats;
+#if !PERSISTENT_JOURNAL
+static FILE *register_file;
+static uint16_t register_values[H_REG_COUNT];
+static uint8_t flg_registers_loaded;
+#endif
+#if IDLE_LINE_FRAMING
+static TIM_TypeDef tim6;
+static TIM_HandleTypeDef htim6 = {.Instance = &tim6};
+
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+	MBR_Timer_Callback(htim);
+}
+#endif
+
+#if !PERSISTENT_JOURNAL
+static uint8_t Read_Register(uint16_t address, uint16_t *data)
+{
+	if(!flg_registers_loaded)	//the first start: MBR_Init_Modbus() writes the default values
+	{
+		return 1;
+	}
+	*data = register_values[(address < H_REG_COUNT) ? address : 0];	//the library reads with the register number (or MBR_FIRST_START_PROBE)
+	return 0;
+}
+
+static uint8_t Write_Register(uint16_t address, uint16_t data)
+{
+	uint16_t index = 0;
+
+	while(index < H_REG_COUNT && (RegVirtAddr[index].virtualAddress != address || RegVirtAddr[index].RW == 2))	//and writes with the virtual address
+	{
+		index++;
+	}
+	if(index == H_REG_COUNT)
+	{
+		return 1;
+	}
+	register_values[index] = data;
+	flg_registers_loaded = 1;
+
+	rewind(register_file);
+	fwrite(register_values, sizeof(register_values), 1, register_file);
+	fflush(register_file);
+	return 0;
+}
+#endif
+
+static void Request_Stats(int signal_number)
+{
+	UNUSED(signal_number);
+	flg_print_stats = 1;
+}
+
+static void Print_Stats(void)
+{
+#if TRAFFIC_STATISTICS
+	const struct structTrafficStats *stats = MBR_Get_Traffic_Stats();
+
+	printf("frames %u, crc errors %u, uart errors %u, requests %u, responses %u\n",
+			stats->frames, stats->crc_errors, stats->uart_errors, stats->requests, stats->responses);
+	printf("turnaround p50 %u us, p99 %u us, p99.9 %u us\n",
+			MBR_Get_Latency_Percentile(500), MBR_Get_Latency_Percentile(990), MBR_Get_Latency_Percentile(999));
+#else
+	printf("build with TRAFFIC_STATISTICS=1\n");
+#endif
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 3)
+	{
+		fprintf(stderr, "usage: %s <serial device> <register file, flash image with PERSISTENT_JOURNAL=1>\n", argv[0]);
+		return 2;
+	}
+
+#if PERSISTENT_JOURNAL
+	if(MBR_Port_Open_Flash(argv[2]) || MBR_Port_Open(&huart, argv[1]))
+	{
+		perror("mbr_slave");
+		return 1;
+	}
+#else
+	register_file = fopen(argv[2], "r+b");
+	if(register_file != NULL)
+	{
+		flg_registers_loaded = fread(register_values, sizeof(register_values), 1, register_file) == 1;
+	}
+	else
+	{
+		register_file = fopen(argv[2], "w+b");
+	}
+	if(register_file == NULL || MBR_Port_Open(&huart, argv[1]))
+	{
+		perror("mbr_slave");
+		return 1;
+	}
+#endif
+
+	signal(SIGUSR1, Request_Stats);
+#if IDLE_LINE_FRAMING
+	MBR_Init_Frame_Timer(&htim6);
+#endif
+#if PERSISTENT_JOURNAL
+	MBR_Init_Modbus(&huart, MBR_Journal_Read, MBR_Journal_Write);
+#else
+	MBR_Init_Modbus(&huart, Read_Register, Write_Register);
+#endif
+
+	for(;;)
+	{
+		MBR_Port_Poll(&huart, 10);
+		MBR_Check_For_Request();
+		if(flg_print_stats)
+		{
+			flg_print_stats = 0;
+			Print_Stats();
+		}
+	}
+}
@@ -0,0 +1,147 @@
+/*mbr_words.c - microbenchmark of the register encoding of the read responses: Encode_Words() of MODBUS.c against the
+  register by register loop it falls back to.
+
+  mbr_words [-i batches] > words.csv
+
+  MODBUS.c is included to reach Encode_Words(). The kernel column tells which path the build took: sse2 on x86-64,
+  avx2 when built with -mavx2 (mbr_words_avx2), loop without a vector kernel. The loop is built without vectorization,
+  as the loop of the target. Every register count is checked once against the loop, then timed in batches of
+  BATCH_SIZE calls: min/p50/p99 are taken over the batch averages, in ns per call.*/
+#define _GNU_SOURCE
+#include "MODBUS.c"
+#include "mbr_bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_SIZE			1024
+#define WARMUP_BATCHES		16	//caches and branch predictors, not reported
+
+#if defined(__AVX2__)
+#define WORDS_KERNEL		"avx2"
+#elif defined(__SSE2__)
+#define WORDS_KERNEL		"sse2"
+#elif defined(__CORTEX_M) && defined(__ARM_FEATURE_UNALIGNED)
+#define WORDS_KERNEL		"rev16"
+#else
+#define WORDS_KERNEL		"loop"
+#endif
+
+static const uint16_t word_counts[] = {1, 2, 8, 11, 16, 32, 64, 125};
+static uint16_t words_src[MAX_READ_REGISTERS];
+static uint8_t words_dst[2*MAX_READ_REGISTERS + 1];	//+1: the data of a response starts at an odd offset
+static uint32_t cnt_batches = 2000;
+
+/*PRIVATE FUNCTIONS PROTOTYPES*/
+static void Encode_Words_Loop(const uint16_t *src, uint16_t count, uint8_t *dst);
+static void Run_Words(const char *kernel, void (*encode)(const uint16_t*, uint16_t, uint8_t*), uint16_t count);
+static uint64_t Bench_Now(void);
+static int Compare_Double(const void *a, const void *b);
+
+
+int main(int argc, char **argv)
+{
+	uint8_t expected[sizeof(words_dst)];
+	int option;
+
+	while((option = getopt(argc, argv, "i:")) != -1)
+	{
+		switch(option)
+		{
+		case 'i':	cnt_batches = strtoul(optarg, NULL, 0);	break;
+		default:
+			fprintf(stderr, "usage: %s [-i batches]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(cnt_batches == 0)
+	{
+		cnt_batches = 1;
+	}
+
+	for(uint16_t i = 0; i < MAX_READ_REGISTERS; i++)
+	{
+		words_src[i] = 0x0102 * i + 0x8001;
+	}
+
+	printf("kernel,registers,iterations,min_ns,p50_ns,p99_ns\n");
+	for(uint8_t n = 0; n < sizeof(word_counts)/sizeof(word_counts[0]); n++)
+	{
+		uint16_t count = word_counts[n];
+
+		memset(expected, 0, sizeof(expected));
+		memset(words_dst, 0, sizeof(words_dst));
+		Encode_Words_Loop(words_src, count, &expected[1]);
+		Encode_Words(words_src, count, &words_dst[1]);
+		if(memcmp(expected, words_dst, sizeof(words_dst)) != 0)
+		{
+			fprintf(stderr, "mbr_words: %s, %u registers: wrong encoding\n", WORDS_KERNEL, count);
+			return 1;
+		}
+
+		Run_Words("loop", Encode_Words_Loop, count);
+		Run_Words(WORDS_KERNEL, Encode_Words, count);
+	}
+	return 0;
+}
+
+
+/*PRIVATE FUNCTIONS*/
+/*the last loop of Encode_Words(), the whole encoding on Cortex-M0 and before the kernels*/
+__attribute__((noinline, optimize("no-tree-vectorize")))
+static void Encode_Words_Loop(const uint16_t *src, uint16_t count, uint8_t *dst)
+{
+	for(uint32_t i = 0; i < count; i++)
+	{
+		dst[2*i] = src[i]>>8;
+		dst[2*i+1] = src[i];
+	}
+}
+
+static void Run_Words(const char *kernel, void (*encode)(const uint16_t*, uint16_t, uint8_t*), uint16_t count)
+{
+	double *batch_ns = malloc(cnt_batches * sizeof(double));
+	uint64_t start;
+
+	if(batch_ns == NULL)
+	{
+		exit(1);
+	}
+
+	for(int32_t batch = -WARMUP_BATCHES; batch < (int32_t)cnt_batches; batch++)
+	{
+		start = Bench_Now();
+		for(uint32_t i = 0; i < BATCH_SIZE; i++)
+		{
+			encode(words_src, count, &words_dst[1]);
+			__asm__ volatile("" ::: "memory");	//every call stores, as into buf_modbus
+		}
+		if(batch >= 0)
+		{
+			batch_ns[batch] = (double)(Bench_Now() - start) / BATCH_SIZE;
+		}
+	}
+
+	qsort(batch_ns, cnt_batches, sizeof(double), Compare_Double);
+	printf("%s,%u,%u,%.1f,%.1f,%.1f\n", kernel, count, cnt_batches * BATCH_SIZE,
+			batch_ns[0], batch_ns[cnt_batches / 2], batch_ns[(uint64_t)cnt_batches * 99 / 100]);
+	free(batch_ns);
+}
+
+static uint64_t Bench_Now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int Compare_Double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,104 @@
+# stack_depth.awk - worst-case stack depth of one translation unit, used by make size
+#   awk [-v irq=regex] -f stack_depth.awk MODBUS.su MODBUS.ci
+# The .su file (-fstack-usage) gives the frame of every function, the .ci file (-fcallgraph-info) the calls.
+# The deepest call path is the largest sum of frames from a function down to a leaf, once from the functions run by
+# the main loop and once from the interrupt entries matched by irq: an interrupt comes on top of the main loop path
+# (one interrupt level, nesting priorities add their own paths).
+# Calls that leave the unit (HAL, weak callbacks defined elsewhere) and indirect calls (the read/write handlers) have
+# no frame here, they are listed below the path: their stack comes on top of it. Recursion is cut at the first
+# repeated function.
+
+FNR == 1 { file++ }
+
+file == 1 {	# file:line:column:name<TAB>bytes<TAB>qualifier
+	split($0, field, "\t")
+	name = field[1]
+	sub(/.*:/, "", name)
+	frame[name] = field[2] + 0
+	if (field[3] != "static") {
+		dynamic[name] = field[3]
+	}
+	next
+}
+
+/^edge:/ {
+	source = Title($0, "sourcename")
+	target = Title($0, "targetname")
+	if (!((source, target) in linked)) {
+		linked[source, target] = 1
+		callees[source] = callees[source] " " target
+	}
+}
+
+END {
+	main_depth = Report("main loop and init", 0)
+	irq_depth = (irq == "") ? 0 : Report("interrupts", 1)
+	printf "worst-case stack: %d bytes\n", main_depth + irq_depth
+}
+
+# deepest path from the functions that match irq (interrupts = 1) or do not (0), returns its depth
+function Report(title, interrupts,    name, root, worst, path, outside, count, list, i, call) {
+	worst = -1
+	for (name in frame) {
+		if (irq != "" && (name ~ irq) != interrupts) {
+			continue
+		}
+		if (Depth(name) > worst || (Depth(name) == worst && name < root)) {
+			worst = Depth(name)
+			root = name
+		}
+	}
+	if (worst < 0) {
+		return 0
+	}
+
+	path = ""
+	outside = ""
+	for (name = root; name != ""; name = next_call[name]) {
+		path = path (path == "" ? "" : " > ") name " " frame[name] (name in dynamic ? "+" : "")
+		count = split(callees[name], list, " ")
+		for (i = 1; i <= count; i++) {
+			call = (list[i] == "__indirect_call") ? "(indirect)" : list[i]
+			if (!(list[i] in frame) && index(outside " ", " " call " ") == 0) {
+				outside = outside " " call
+			}
+		}
+	}
+	printf "%s: %d bytes\n  %s\n", title, worst, path
+	if (outside != "") {
+		printf "  not counted, called on the path:%s\n", outside
+	}
+	return worst
+}
+
+# node title without the file prefix of static functions
+function Title(line, key,    value) {
+	value = line
+	sub(".*" key ": \"", "", value)
+	sub(/".*/, "", value)
+	sub(/.*:/, "", value)
+	return value
+}
+
+# frame of the function plus the deepest of its callees, memoized
+function Depth(name,    count, list, i, sub_depth, best) {
+	if (name in depth) {
+		return depth[name]
+	}
+	if (!(name in frame)) {
+		return 0
+	}
+	depth[name] = frame[name]	# a recursive call sees the frame alone
+	best = 0
+	next_call[name] = ""
+	count = split(callees[name], list, " ")
+	for (i = 1; i <= count; i++) {
+		sub_depth = Depth(list[i])
+		if (sub_depth > best && list[i] in frame) {
+			best = sub_depth
+			next_call[name] = list[i]
+		}
+	}
+	depth[name] = frame[name] + best
+	return depth[name]
+}